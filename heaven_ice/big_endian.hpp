@@ -0,0 +1,25 @@
+#pragma once
+
+#include <bit>
+#include <cstring>
+
+#include "types.hpp"
+
+namespace heaven_ice {
+
+// 68k memory is big endian, these read and write values from host memory with
+// a single load or store plus a byte swap
+template <class T> inline T load_be(const ubyte_t* ptr)
+{
+  T v;
+  std::memcpy(&v, ptr, sizeof(T));
+  return std::byteswap(v);
+}
+
+template <class T> inline void store_be(ubyte_t* ptr, T v)
+{
+  v = std::byteswap(v);
+  std::memcpy(ptr, &v, sizeof(T));
+}
+
+} // namespace heaven_ice
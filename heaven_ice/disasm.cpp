@@ -363,10 +363,9 @@ struct Program {
   std::map<ulong_t, std::string> labels;
 };
 
-bee::OrError<Program> disasm_all(const std::string& rom_content)
+bee::OrError<Program> disasm_all(const Rom::ptr& rom)
 {
-  auto rom = std::make_shared<Memory>(rom_content);
-  bail(d, DisasmImpl::create(rom));
+  bail(d, DisasmImpl::create(std::make_shared<Memory>(rom)));
 
   std::map<ulong_t, Instruction> insts;
 
@@ -433,7 +432,7 @@ bee::OrError<Program> disasm_all(const std::string& rom_content)
 
 } // namespace
 
-bee::OrError<> Disasm::disasm_and_print(const std::string& rom)
+bee::OrError<> Disasm::disasm_and_print(const Rom::ptr& rom)
 {
   bail(p, disasm_all(rom));
   auto&& insts = p.insts;
@@ -457,7 +456,7 @@ bee::OrError<> Disasm::disasm_and_print(const std::string& rom)
 
   ulong_t pc = 0;
   int last_block_kind = 1;
-  while (pc < rom.size()) {
+  while (pc < rom->size()) {
     if (auto it = labels.find(pc); it != labels.end()) {
       P("\n$:", it->second);
       last_block_kind = 1;
@@ -468,7 +467,8 @@ bee::OrError<> Disasm::disasm_and_print(const std::string& rom)
     if (inst.pc > pc) {
       auto next_pc = std::min(label_addr, inst.pc);
       if (last_block_kind != 1) { P(""); }
-      HexView::print_hex(pc, rom.substr(pc, next_pc - pc));
+      auto end = std::min<size_t>(next_pc, rom->size());
+      HexView::print_hex(pc, rom->data().subspan(pc, end - pc));
       pc = next_pc;
       last_block_kind = 2;
     } else {
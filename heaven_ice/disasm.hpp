@@ -5,6 +5,7 @@
 
 #include "instruction.hpp"
 #include "io_intf.hpp"
+#include "rom.hpp"
 
 #include "bee/or_error.hpp"
 
@@ -18,7 +19,7 @@ struct Disasm {
 
   static bee::OrError<ptr> create(const IOIntf::ptr& bus);
 
-  static bee::OrError<> disasm_and_print(const std::string& rom_content);
+  static bee::OrError<> disasm_and_print(const Rom::ptr& rom);
 };
 
 } // namespace heaven_ice
@@ -1,5 +1,7 @@
 #include "display_ffmpeg.hpp"
 
+#include <array>
+
 #include "bee/file_path.hpp"
 #include "bee/filesystem.hpp"
 #include "bee/format.hpp"
@@ -18,19 +20,33 @@ struct DisplayFfmpegImpl final : public DisplayIntf {
     }
   }
 
-  void update(const pixel::Image& img) override
+  // Frames go to ffmpeg as pal8, the indexed pixels followed by the palette,
+  // and ffmpeg does the conversion and the scaling
+  void update(const IndexedFrame& frame) override
   {
-    if (_scale != 1) {
-      _update_impl(img.upscale(_scale));
-    } else {
-      _update_impl(img);
+    if (_input_pipe == nullptr) { _init_proc(); }
+
+    // Each entry is a native endian 0xAARRGGBB
+    std::array<ulong_t, 256> palette;
+    auto colors = frame.colors();
+    for (size_t i = 0; i < colors.size(); i++) {
+      const auto& c = colors[i];
+      palette[i] =
+        0xff000000 | (ulong_t(c.r) << 16) | (ulong_t(c.g) << 8) | ulong_t(c.b);
     }
+
+    must_unit(_input_pipe->write(
+      reinterpret_cast<const char*>(frame.pixels.data()),
+      frame.pixels.size()));
+    must_unit(_input_pipe->write(
+      reinterpret_cast<const char*>(palette.data()),
+      palette.size() * sizeof(ulong_t)));
   }
 
   std::vector<sdl::Event> get_events() override { return {}; }
 
  private:
-  void _init_proc(int height, int width)
+  void _init_proc()
   {
     auto input_pipe = bee::SubProcess::Pipe::create();
     must_assign(
@@ -42,13 +58,15 @@ struct DisplayFfmpegImpl final : public DisplayIntf {
             "-f",
             "rawvideo",
             "-pixel_format",
-            "rgb24",
+            "pal8",
             "-video_size",
-            F("$x$", width, height),
+            F("$x$", IndexedFrame::Width, IndexedFrame::Height),
             "-framerate",
             "60",
             "-i",
             "-",
+            "-vf",
+            F("scale=iw*$:ih*$:flags=neighbor", _scale, _scale),
             "-vcodec",
             "libx264",
             "-crf",
@@ -63,14 +81,6 @@ struct DisplayFfmpegImpl final : public DisplayIntf {
     _input_pipe = input_pipe->fd();
   }
 
-  void _update_impl(const pixel::Image& img)
-  {
-    if (_input_pipe == nullptr) { _init_proc(img.height(), img.width()); }
-    must_unit(_input_pipe->write(
-      reinterpret_cast<const char*>(img.data()),
-      img.height() * img.width() * 3));
-  }
-
   bee::FD::shared_ptr _input_pipe;
   bee::SubProcess::ptr _ffmpeg_proc;
 
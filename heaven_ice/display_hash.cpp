@@ -10,8 +10,10 @@ struct DisplayHashImpl final : public DisplayIntf {
   DisplayHashImpl() {}
   virtual ~DisplayHashImpl() {}
 
-  void update(const pixel::Image& img) override
+  // Hashes the RGB image, so the hash only depends on what is shown
+  void update(const IndexedFrame& frame) override
   {
+    auto img = frame.to_image();
     bee::SimpleChecksum cs;
     cs.add_string(reinterpret_cast<const char*>(img.data()), img.data_size());
     P(cs.hex());
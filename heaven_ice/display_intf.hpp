@@ -2,9 +2,9 @@
 
 #include <vector>
 
+#include "indexed_frame.hpp"
 #include "input_event.hpp"
 
-#include "pixel/image.hpp"
 #include "sdl/event.hpp"
 
 namespace heaven_ice {
@@ -15,7 +15,7 @@ struct DisplayIntf {
 
   ~DisplayIntf();
 
-  virtual void update(const pixel::Image& img) = 0;
+  virtual void update(const IndexedFrame& frame) = 0;
 
   virtual std::vector<sdl::Event> get_events() = 0;
 };
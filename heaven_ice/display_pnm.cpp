@@ -13,10 +13,11 @@ struct DisplayPnmImpl final : public DisplayIntf {
   DisplayPnmImpl() { must_unit(bee::FileSystem::mkdirs(OutputDir)); }
   virtual ~DisplayPnmImpl() {}
 
-  void update(const pixel::Image& img) override
+  void update(const IndexedFrame& frame) override
   {
     _counter++;
-    img.save_pnm(OutputDir / bee::FilePath(F("screenshot_{06}.pnm", _counter)));
+    frame.to_image().save_pnm(
+      OutputDir / bee::FilePath(F("screenshot_{06}.pnm", _counter)));
   }
 
   std::vector<sdl::Event> get_events() override { return {}; }
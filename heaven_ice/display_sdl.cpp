@@ -19,9 +19,9 @@ namespace {
 struct DisplaySDLImpl final : public DisplayIntf {
   virtual ~DisplaySDLImpl() {}
 
-  void update(const pixel::Image& img) override
+  void update(const IndexedFrame& frame) override
   {
-    must_unit(_ren->fill_all(img));
+    must_unit(_ren->fill_all(frame.to_image()));
     _ren->present();
   }
 
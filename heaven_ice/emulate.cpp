@@ -1,8 +1,12 @@
 #include "emulate.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <memory>
 #include <string>
-#include <unordered_set>
+#include <unordered_map>
+#include <vector>
 
 #include "disasm.hpp"
 #include "inst_enum.hpp"
@@ -10,6 +14,7 @@
 #include "instruction.hpp"
 #include "machine.hpp"
 #include "magic_constants.hpp"
+#include "micro_op.hpp"
 #include "save_state.hpp"
 
 #include "bee/file_path.hpp"
@@ -17,6 +22,7 @@
 #include "bee/file_writer.hpp"
 #include "bee/or_error.hpp"
 #include "bee/print.hpp"
+#include "bee/time.hpp"
 
 namespace heaven_ice {
 namespace {
@@ -29,7 +35,6 @@ template <class T> T op2(InstEnum inst, T dst, T src)
 {
   switch (inst) {
   case InstEnum::ADD:
-  case InstEnum::ADDA:
   case InstEnum::ADDI:
   case InstEnum::ADDQ:
     return ADD<T>(dst, src);
@@ -40,7 +45,6 @@ template <class T> T op2(InstEnum inst, T dst, T src)
   case InstEnum::BCHG:
     return BCHG<T>(dst, src);
   case InstEnum::SUB:
-  case InstEnum::SUBA:
   case InstEnum::SUBI:
   case InstEnum::SUBQ:
     return SUB<T>(dst, src);
@@ -94,6 +98,22 @@ slong_t op2(InstEnum inst, SizeKind size, slong_t dst, slong_t src)
   }
 }
 
+// ADDA, SUBA, and ADDQ and SUBQ to an address register, which don't touch the
+// condition codes
+slong_t addr_reg_op2(InstEnum inst, slong_t dst, slong_t src)
+{
+  switch (inst) {
+  case InstEnum::ADDA:
+  case InstEnum::ADDQ:
+    return ADD_NF<L>(dst, src);
+  case InstEnum::SUBA:
+  case InstEnum::SUBQ:
+    return SUB_NF<L>(dst, src);
+  default:
+    raise_error("BUG!");
+  }
+}
+
 template <class T> void cmp_op2(InstEnum inst, T dst, T src)
 {
   switch (inst) {
@@ -168,308 +188,434 @@ void TSTS(SizeKind size, slong_t value)
   }
 }
 
+void execute(
+  const Instruction& inst, Machine& machine, CpuState& cpu, bool verbose)
+{
+  switch (inst.name) {
+  case InstEnum::TST: {
+    auto size = inst.size.value();
+    auto value = machine.read_value(size, inst.src.value());
+    TSTS(size, value);
+  } break;
+  case InstEnum::CLR: {
+    auto size = inst.size.value();
+    machine.write_value(size, inst.dst.value(), 0);
+  } break;
+  case InstEnum::Bcc: {
+    auto cond = inst.cond.value();
+    auto addr = machine.read_address(SizeKind::l(), inst.src.value());
+
+    if (verbose) P("SR: $", G.sr);
+    if (G.sr.check_condition(cond)) {
+      if (verbose) P("Branch taken");
+      cpu.pc = addr.get_ram_addr();
+    }
+  } break;
+  case InstEnum::LEA: {
+    auto size = inst.size.value();
+    auto src_value = machine.read_address(size, inst.src.value());
+    machine.write_value(size, inst.dst.value(), src_value.get_ram_addr());
+  } break;
+  case InstEnum::MOVEM: {
+    // The address is computed once and the registers move as one block
+    auto size = inst.size.value();
+    auto l = inst.register_list.value();
+    std::array<RegisterId, 16> regs;
+    int count = 0;
+    for (int i = 0; i < 16; i++) {
+      if (l.contains(i)) regs[count++] = l.reg(i);
+    }
+    slong_t bytes = count * size.num_bytes();
+    std::array<slong_t, 16> values;
+    auto am = inst.src.has_value() ? inst.src.value() : inst.dst.value();
+    ulong_t addr;
+    switch (am.kind) {
+    case AddrModeKind::PostInc:
+    case AddrModeKind::PreDec:
+      addr = machine.read_register(SizeKind::l(), am.reg);
+      break;
+    default:
+      addr = machine.read_address(size, am).get_ram_addr();
+      break;
+    }
+    if (inst.src.has_value()) {
+      G.io->read_signed_block(size, addr, values.data(), count);
+      for (int i = 0; i < count; i++) {
+        machine.write_register(SizeKind::l(), regs[i], values[i]);
+      }
+      if (am.kind == AddrModeKind::PostInc) {
+        machine.write_register(SizeKind::l(), am.reg, addr + bytes);
+      }
+    } else {
+      for (int i = 0; i < count; i++) {
+        values[i] = machine.read_register(size, regs[i]);
+      }
+      if (am.kind == AddrModeKind::PreDec) {
+        // The first register in the list goes to the highest address
+        std::reverse(values.begin(), values.begin() + count);
+        addr -= bytes;
+        machine.write_register(SizeKind::l(), am.reg, addr);
+      }
+      G.io->write_signed_block(size, addr, values.data(), count);
+    }
+  } break;
+  case InstEnum::DBcc: {
+    auto size = inst.size.value();
+    auto cond = inst.cond.value();
+    auto dst = inst.dst.value();
+    auto src_addr = machine.read_address(SizeKind::l(), inst.src.value());
+
+    if (verbose) P("SR: $", G.sr);
+    if (!G.sr.check_condition(cond)) {
+      auto value = machine.read_value(size, dst) - 1;
+      machine.write_value(size, dst, value);
+      if (value != -1) {
+        if (verbose) P("Branch taken");
+        cpu.pc = src_addr.get_ram_addr();
+      }
+    }
+  } break;
+  case InstEnum::ABCD:
+  case InstEnum::ADD:
+  case InstEnum::ADDA:
+  case InstEnum::ADDI:
+  case InstEnum::ADDQ:
+  case InstEnum::AND:
+  case InstEnum::ANDI:
+  case InstEnum::ASL:
+  case InstEnum::ASR:
+  case InstEnum::BSET:
+  case InstEnum::BCLR:
+  case InstEnum::BCHG:
+  case InstEnum::EOR:
+  case InstEnum::EORI:
+  case InstEnum::LSL:
+  case InstEnum::LSR:
+  case InstEnum::OR:
+  case InstEnum::ORI:
+  case InstEnum::ORI_to_SR:
+  case InstEnum::ANDI_to_SR:
+  case InstEnum::ROL:
+  case InstEnum::ROR:
+  case InstEnum::SUB:
+  case InstEnum::SUBA:
+  case InstEnum::SUBI:
+  case InstEnum::SUBQ: {
+    auto src_size = inst.size.value();
+    auto dst = inst.dst.value();
+    auto dst_size = dst.is_addr_reg() ? SizeKind::l() : inst.size.value();
+    auto src = inst.src.value();
+
+    auto dst_addr = machine.read_address(dst_size, dst);
+    auto src_addr = machine.read_address(src_size, src);
+
+    auto dst_value = machine.read_value(dst_size, dst_addr);
+    auto src_value = machine.read_value(src_size, src_addr);
+    auto result = inst.is_addr_reg_update()
+                    ? addr_reg_op2(inst.name, dst_value, src_value)
+                    : op2(inst.name, dst_size, dst_value, src_value);
+    machine.write_value(dst_size, dst_addr, result);
+  } break;
+  case InstEnum::EXG: {
+    auto size = inst.size.value();
+    auto src = inst.src.value();
+    auto dst = inst.dst.value();
+
+    auto dst_addr = machine.read_address(size, dst);
+    auto src_addr = machine.read_address(size, src);
+
+    auto dst_value = machine.read_value(size, dst_addr);
+    auto src_value = machine.read_value(size, src_addr);
+
+    machine.write_value(size, dst_addr, src_value);
+    machine.write_value(size, src_addr, dst_value);
+
+  } break;
+  case InstEnum::MULS:
+  case InstEnum::MULU: {
+    SizeKind size = SizeKind::w();
+    SizeKind res_size = SizeKind::l();
+
+    auto dst_addr = machine.read_address(size, inst.dst.value());
+    auto src_addr = machine.read_address(size, inst.src.value());
+    auto result = op2(
+      inst.name,
+      res_size,
+      machine.read_value(size, dst_addr),
+      machine.read_value(size, src_addr));
+    machine.write_value(res_size, dst_addr, result);
+  } break;
+  case InstEnum::DIVS:
+  case InstEnum::DIVU: {
+    SizeKind src_size = SizeKind::w();
+    SizeKind dst_size = SizeKind::l();
+
+    auto dst_addr = machine.read_address(dst_size, inst.dst.value());
+    auto src_addr = machine.read_address(src_size, inst.src.value());
+    auto result = op2(
+      inst.name,
+      dst_size,
+      machine.read_value(dst_size, dst_addr),
+      machine.read_value(src_size, src_addr));
+    machine.write_value(dst_size, dst_addr, result);
+  } break;
+  case InstEnum::MOVE_to_SR:
+  case InstEnum::MOVE_from_SR:
+  case InstEnum::MOVEQ:
+  case InstEnum::MOVE:
+  case InstEnum::MOVE_USP: {
+    auto size = inst.size.value();
+    auto src = inst.src.value();
+    auto dst = inst.dst.value();
+
+    auto value = machine.read_value(size, src);
+    machine.write_value(size, dst, value);
+
+    switch (inst.name) {
+    case InstEnum::MOVE:
+    case InstEnum::MOVEQ:
+      if (!inst.is_addr_reg_update()) { TSTS(size, value); }
+      break;
+    default:
+      break;
+    }
+  } break;
+  case InstEnum::JMP: {
+    cpu.pc =
+      machine.read_address(SizeKind::l(), inst.src.value()).get_ram_addr();
+    cpu.log_jump(cpu.pc);
+  } break;
+  case InstEnum::BSR:
+  case InstEnum::JSR: {
+    machine.push(SizeKind::l(), cpu.pc);
+    cpu.pc =
+      machine.read_address(SizeKind::l(), inst.src.value()).get_ram_addr();
+    if (inst.name == InstEnum::JSR) { cpu.log_jump(cpu.pc); }
+  } break;
+  case InstEnum::RTS: {
+    cpu.pc = machine.pop(SizeKind::l());
+  } break;
+  case InstEnum::EXT:
+  case InstEnum::SWAP:
+  case InstEnum::NEG:
+  case InstEnum::NOT: {
+    auto size = inst.size.value();
+    auto dst_addr = machine.read_address(size, inst.dst.value());
+    ulong_t dst = machine.read_value(size, dst_addr);
+    ulong_t new_value = op1(inst.name, size, dst);
+    machine.write_value(size, dst_addr, new_value);
+  } break;
+  case InstEnum::BTST:
+  case InstEnum::CMP:
+  case InstEnum::CMPA:
+  case InstEnum::CMPI: {
+    auto size = inst.size.value();
+    auto src_addr = machine.read_address(size, inst.src.value());
+    auto dst_addr = machine.read_address(size, inst.dst.value());
+
+    int64_t dst = machine.read_value(size, dst_addr);
+    int64_t src = machine.read_value(size, src_addr);
+    cmp_op2(inst.name, size, dst, src);
+  } break;
+  case InstEnum::NOP: {
+  } break;
+  case InstEnum::RTE: {
+    G.sr.set_from_int(machine.pop(SizeKind::w()));
+    cpu.pc = machine.pop(SizeKind::l());
+    cpu.is_interrupting = false;
+    G.vblank();
+  } break;
+  default:
+    raise_error("Not implemented: $", inst.name);
+  }
+}
+
+// Blocks are cut at any instruction that can change the pc and at
+// MaxBlockSize instructions, so interrupts are never delayed by much
+constexpr size_t MaxBlockSize = 64;
+
+struct Block {
+  ulong_t pc;
+  std::vector<Instruction> insts;
+
+  // Only populated when micro ops are enabled, parallel to insts
+  std::vector<MicroOp> ops;
+
+  ulong_t fall_through_pc;
+  std::optional<ulong_t> taken_pc;
+
+  // Direct links to the successors, filled the first time they are taken
+  Block* fall_through = nullptr;
+  Block* taken = nullptr;
+
+  static bool ends_block(const Instruction& inst)
+  {
+    return inst.is_unconditional_jump() || inst.is_conditional_jump() ||
+           inst.is_fn_call();
+  }
+};
+
+struct BlockCache {
+ public:
+  BlockCache(const Disasm::ptr& disasm, bool micro_ops)
+      : _disasm(disasm), _micro_ops(micro_ops)
+  {}
+
+  bee::OrError<Block*> get(ulong_t pc)
+  {
+    auto it = _blocks.find(pc);
+    if (it != _blocks.end()) { return it->second.get(); }
+    bail(block, build(pc));
+    auto ret = block.get();
+    _blocks.emplace(pc, std::move(block));
+    return ret;
+  }
+
+  // Follows the direct links when the pc matches one of the successors of the
+  // block, only falling back to the hash lookup the first time
+  bee::OrError<Block*> next(Block& block, ulong_t pc)
+  {
+    if (pc == block.fall_through_pc) {
+      if (block.fall_through == nullptr) {
+        bail_assign(block.fall_through, get(pc));
+      }
+      return block.fall_through;
+    } else if (pc == block.taken_pc) {
+      if (block.taken == nullptr) { bail_assign(block.taken, get(pc)); }
+      return block.taken;
+    }
+    return get(pc);
+  }
+
+  size_t size() const { return _blocks.size(); }
+
+ private:
+  bee::OrError<std::unique_ptr<Block>> build(ulong_t pc)
+  {
+    if (pc % 2 == 1) { return EF("PC cannot be odd: {x}", pc); }
+    auto block = std::make_unique<Block>();
+    block->pc = pc;
+    while (true) {
+      bail(inst, _disasm->disasm_one(pc));
+      pc += inst.bytes;
+      if (_micro_ops) { block->ops.push_back(MicroOp::lower(inst)); }
+      block->insts.push_back(std::move(inst));
+      const auto& last = block->insts.back();
+      if (Block::ends_block(last)) {
+        block->taken_pc = last.jump_addr();
+        break;
+      }
+      if (block->insts.size() >= MaxBlockSize) { break; }
+    }
+    block->fall_through_pc = pc;
+    return block;
+  }
+
+  Disasm::ptr _disasm;
+  bool _micro_ops;
+  std::unordered_map<ulong_t, std::unique_ptr<Block>> _blocks;
+};
+
 } // namespace
 
 bee::OrError<> Emulate::main(
   bool show_registers,
   bool verbose,
+  bool micro_ops,
   const std::optional<uint64_t> max_instructions,
   const std::optional<bee::FilePath> load_state,
   const std::optional<bee::FilePath> save_state)
 {
+  if (micro_ops && verbose) {
+    return EF("Micro ops don't support verbose mode");
+  }
+
   bail(disasm, Disasm::create(G.io));
-  std::vector<std::optional<Instruction>> instruction_cache;
+  BlockCache blocks(disasm, micro_ops);
 
   Machine machine(verbose);
   uint64_t instruction_count = 0;
+  uint64_t next_frame = InstsPerFrame;
+  uint64_t next_save = 0;
 
-  std::unordered_set<ulong_t> seen_jumps;
-  auto maybe_log_jump = [&](ulong_t addr) {
-    if (!seen_jumps.contains(addr)) {
-      P("New jump addr: 0x{05x}", addr);
-      seen_jumps.insert(addr);
-    }
-  };
-
-  ulong_t pc = 0x200;
-  bool is_interrupting = false;
+  CpuState cpu;
 
   if (load_state.has_value()) {
     must(reader, bee::FileReader::open(*load_state));
     G.load_state(*reader);
-    load_state_gen(pc, *reader);
-    load_state_gen(is_interrupting, *reader);
+    load_state_gen(cpu.pc, *reader);
+    load_state_gen(cpu.is_interrupting, *reader);
 
     P("loaded state from file: $", *load_state);
   }
 
+  auto run_block = [&](const Block& block) {
+    for (size_t i = 0; i < block.insts.size(); i++) {
+      if (verbose) P(sep);
+      StatusRegister initial_sr = G.sr;
+      const auto& inst = block.insts[i];
+      if (!block.ops.empty() && block.ops[i].handler != nullptr) {
+        const auto& op = block.ops[i];
+        cpu.pc = op.next_pc;
+        op.handler(op, cpu);
+      } else {
+        if (verbose) P("{06x}: $", cpu.pc, inst);
+        cpu.pc += inst.bytes;
+        execute(inst, machine, cpu, verbose);
+      }
+      if (verbose)
+        if (G.sr != initial_sr) { P("SR: $", G.sr); }
+
+      if (show_registers) { machine.print_registers(); }
+    }
+    instruction_count += block.insts.size();
+  };
+
+  auto start = bee::Time::now();
+
+  // Limit, save state and interrupt checks are only done between blocks
+  Block* block = nullptr;
+  bail_assign(block, blocks.get(cpu.pc));
   while (true) {
     if (
       max_instructions.has_value() && instruction_count >= *max_instructions) {
       P("Maximum instructions reached");
+      P("Executed $ instructions in $ using $ blocks",
+        instruction_count,
+        bee::Time::now() - start,
+        blocks.size());
       break;
     }
-    if (verbose) P(sep);
-    StatusRegister initial_sr = G.sr;
-    instruction_count++;
-    if (save_state && (instruction_count % (1 << 23)) == 1) {
+    if (save_state && instruction_count >= next_save) {
       P("Saving state...");
       must(writer, bee::FileWriter::create(*save_state));
       G.save_state(*writer);
-      save_state_gen(pc, *writer);
-      save_state_gen(is_interrupting, *writer);
-    }
-    if (pc % 2 == 1) { return EF("PC cannot be odd: {x}", pc); }
-    ulong_t inst_idx = pc / 2;
-    if (inst_idx >= instruction_cache.size()) {
-      instruction_cache.resize(
-        std::max<size_t>(instruction_cache.size() * 2, inst_idx + 1));
-      if (verbose)
-        P("Instruction cache resized: $, $ bytes",
-          instruction_cache.size(),
-          instruction_cache.size() * sizeof(Instruction));
-    }
-    const auto& inst_opt = instruction_cache[inst_idx];
-    if (!inst_opt.has_value()) {
-      bail_assign(instruction_cache[inst_idx], disasm->disasm_one(pc));
+      save_state_gen(cpu.pc, *writer);
+      save_state_gen(cpu.is_interrupting, *writer);
+      next_save += 1 << 23;
     }
-    const auto& inst = *inst_opt;
-    if (verbose) P("{06x}: $", pc, inst);
-    pc += inst.bytes;
-    switch (inst.name) {
-    case InstEnum::TST: {
-      auto size = inst.size.value();
-      auto value = machine.read_value(size, inst.src.value());
-      TSTS(size, value);
-    } break;
-    case InstEnum::CLR: {
-      auto size = inst.size.value();
-      machine.write_value(size, inst.dst.value(), 0);
-    } break;
-    case InstEnum::Bcc: {
-      auto cond = inst.cond.value();
-      auto addr = machine.read_address(SizeKind::l(), inst.src.value());
-
-      if (verbose) P("SR: $", G.sr);
-      if (G.sr.check_condition(cond)) {
-        if (verbose) P("Branch taken");
-        pc = addr.get_ram_addr();
-      }
-    } break;
-    case InstEnum::LEA: {
-      auto size = inst.size.value();
-      auto src_value = machine.read_address(size, inst.src.value());
-      machine.write_value(size, inst.dst.value(), src_value.get_ram_addr());
-    } break;
-    case InstEnum::MOVEM: {
-      auto size = inst.size.value();
-      auto l = inst.register_list.value();
-      int offset = 0;
-      for (int i = 0; i < 16; i++) {
-        if (!l.contains(i)) continue;
-        auto r = l.reg(i);
-        if (inst.src.has_value()) {
-          int inc_addr =
-            inst.src->is_inc_or_dec() ? 0 : offset * size.num_bytes();
-          machine.write_register(
-            SizeKind::l(),
-            r,
-            machine.read_value(size, inst.src.value(), inc_addr));
-        } else {
-          int inc_addr =
-            inst.dst->is_inc_or_dec() ? 0 : offset * size.num_bytes();
-          machine.write_value(
-            size, inst.dst.value(), machine.read_register(size, r), inc_addr);
-        }
-        offset++;
-      }
-    } break;
-    case InstEnum::DBcc: {
-      auto size = inst.size.value();
-      auto cond = inst.cond.value();
-      auto dst = inst.dst.value();
-      auto src_addr = machine.read_address(SizeKind::l(), inst.src.value());
-
-      if (verbose) P("SR: $", G.sr);
-      if (!G.sr.check_condition(cond)) {
-        auto value = machine.read_value(size, dst) - 1;
-        machine.write_value(size, dst, value);
-        if (value != -1) {
-          if (verbose) P("Branch taken");
-          pc = src_addr.get_ram_addr();
-        }
-      }
-    } break;
-    case InstEnum::ABCD:
-    case InstEnum::ADD:
-    case InstEnum::ADDA:
-    case InstEnum::ADDI:
-    case InstEnum::ADDQ:
-    case InstEnum::AND:
-    case InstEnum::ANDI:
-    case InstEnum::ASL:
-    case InstEnum::ASR:
-    case InstEnum::BSET:
-    case InstEnum::BCLR:
-    case InstEnum::BCHG:
-    case InstEnum::EOR:
-    case InstEnum::EORI:
-    case InstEnum::LSL:
-    case InstEnum::LSR:
-    case InstEnum::OR:
-    case InstEnum::ORI:
-    case InstEnum::ORI_to_SR:
-    case InstEnum::ANDI_to_SR:
-    case InstEnum::ROL:
-    case InstEnum::ROR:
-    case InstEnum::SUB:
-    case InstEnum::SUBA:
-    case InstEnum::SUBI:
-    case InstEnum::SUBQ: {
-      auto src_size = inst.size.value();
-      auto dst = inst.dst.value();
-      auto dst_size = dst.is_addr_reg() ? SizeKind::l() : inst.size.value();
-      auto src = inst.src.value();
-
-      auto dst_addr = machine.read_address(dst_size, dst);
-      auto src_addr = machine.read_address(src_size, src);
-
-      auto result = op2(
-        inst.name,
-        dst_size,
-        machine.read_value(dst_size, dst_addr),
-        machine.read_value(src_size, src_addr));
-      machine.write_value(dst_size, dst_addr, result);
-    } break;
-    case InstEnum::EXG: {
-      auto size = inst.size.value();
-      auto src = inst.src.value();
-      auto dst = inst.dst.value();
-
-      auto dst_addr = machine.read_address(size, dst);
-      auto src_addr = machine.read_address(size, src);
-
-      auto dst_value = machine.read_value(size, dst_addr);
-      auto src_value = machine.read_value(size, src_addr);
-
-      machine.write_value(size, dst_addr, src_value);
-      machine.write_value(size, src_addr, dst_value);
-
-    } break;
-    case InstEnum::MULS:
-    case InstEnum::MULU: {
-      SizeKind size = SizeKind::w();
-      SizeKind res_size = SizeKind::l();
-
-      auto dst_addr = machine.read_address(size, inst.dst.value());
-      auto src_addr = machine.read_address(size, inst.src.value());
-      auto result = op2(
-        inst.name,
-        res_size,
-        machine.read_value(size, dst_addr),
-        machine.read_value(size, src_addr));
-      machine.write_value(res_size, dst_addr, result);
-    } break;
-    case InstEnum::DIVS:
-    case InstEnum::DIVU: {
-      SizeKind src_size = SizeKind::w();
-      SizeKind dst_size = SizeKind::l();
-
-      auto dst_addr = machine.read_address(dst_size, inst.dst.value());
-      auto src_addr = machine.read_address(src_size, inst.src.value());
-      auto result = op2(
-        inst.name,
-        dst_size,
-        machine.read_value(dst_size, dst_addr),
-        machine.read_value(src_size, src_addr));
-      machine.write_value(dst_size, dst_addr, result);
-    } break;
-    case InstEnum::MOVE_to_SR:
-    case InstEnum::MOVE_from_SR:
-    case InstEnum::MOVEQ:
-    case InstEnum::MOVE:
-    case InstEnum::MOVE_USP: {
-      auto size = inst.size.value();
-      auto src = inst.src.value();
-      auto dst = inst.dst.value();
-
-      auto value = machine.read_value(size, src);
-      machine.write_value(size, dst, value);
-
-      switch (inst.name) {
-      case InstEnum::MOVE:
-      case InstEnum::MOVEQ:
-        TSTS(size, value);
-        break;
-      default:
-        break;
-      }
-    } break;
-    case InstEnum::JMP: {
-      pc = machine.read_address(SizeKind::l(), inst.src.value()).get_ram_addr();
-      maybe_log_jump(pc);
-    } break;
-    case InstEnum::BSR:
-    case InstEnum::JSR: {
-      machine.push(SizeKind::l(), pc);
-      pc = machine.read_address(SizeKind::l(), inst.src.value()).get_ram_addr();
-      if (inst.name == InstEnum::JSR) { maybe_log_jump(pc); }
-    } break;
-    case InstEnum::RTS: {
-      pc = machine.pop(SizeKind::l());
-    } break;
-    case InstEnum::EXT:
-    case InstEnum::SWAP:
-    case InstEnum::NEG:
-    case InstEnum::NOT: {
-      auto size = inst.size.value();
-      auto dst_addr = machine.read_address(size, inst.dst.value());
-      ulong_t dst = machine.read_value(size, dst_addr);
-      ulong_t new_value = op1(inst.name, size, dst);
-      machine.write_value(size, dst_addr, new_value);
-    } break;
-    case InstEnum::BTST:
-    case InstEnum::CMP:
-    case InstEnum::CMPA:
-    case InstEnum::CMPI: {
-      auto size = inst.size.value();
-      auto src_addr = machine.read_address(size, inst.src.value());
-      auto dst_addr = machine.read_address(size, inst.dst.value());
-
-      int64_t dst = machine.read_value(size, dst_addr);
-      int64_t src = machine.read_value(size, src_addr);
-      cmp_op2(inst.name, size, dst, src);
-    } break;
-    case InstEnum::NOP: {
-    } break;
-    case InstEnum::RTE: {
-      G.sr.set_from_int(machine.pop(SizeKind::w()));
-      pc = machine.pop(SizeKind::l());
-      is_interrupting = false;
-      G.vblank();
-    } break;
-    default:
-      raise_error("Not implemented: $", inst.name);
-    }
-    if (verbose)
-      if (G.sr != initial_sr) { P("SR: $", G.sr); }
 
-    if (show_registers) { machine.print_registers(); }
+    run_block(*block);
 
-    if (instruction_count % InstsPerFrame == 0) {
+    if (instruction_count >= next_frame) {
+      next_frame += InstsPerFrame;
       if (verbose) P(sep);
-      if (G.is_vblank_enabled() && !is_interrupting) {
+      if (G.is_vblank_enabled() && !cpu.is_interrupting) {
         if (verbose) P("Interrupt: VBLANK");
-        machine.push(SizeKind::l(), pc);
+        machine.push(SizeKind::l(), cpu.pc);
         machine.push(SizeKind::w(), G.sr.to_int());
         ulong_t handler =
           machine.read_value(SizeKind::l(), Addr::ram(VBLANK_INTERRUPT));
-        pc = handler;
-        is_interrupting = true;
+        cpu.pc = handler;
+        cpu.is_interrupting = true;
+        bail_assign(block, blocks.get(cpu.pc));
+        continue;
       } else {
         if (verbose) P("VBLANK skipped");
       }
     }
+
+    bail_assign(block, blocks.next(*block, cpu.pc));
   }
 
   return bee::ok();
@@ -9,6 +9,7 @@ struct Emulate {
   static bee::OrError<> main(
     bool show_registers,
     bool verbose,
+    bool micro_ops,
     const std::optional<uint64_t> max_instructions,
     const std::optional<bee::FilePath> load_state,
     const std::optional<bee::FilePath> save_state);
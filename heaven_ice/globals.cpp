@@ -102,9 +102,10 @@ struct Globals::GlobalsImpl {
         _speed_mult(SpeedScale / _speed),
         _skip_to_frame(args.skip_to_frame),
         _exit_after_playback(args.exit_after_playback),
+        _start_time(bee::Time::now()),
         _last_frame(bee::Time::now())
   {
-    auto rom = std::make_shared<Memory>(args.rom_content);
+    auto rom = std::make_shared<Memory>(args.rom);
     auto ram = std::make_shared<Memory>(RAM_END - RAM_BEGIN);
 
     if (args.display.has_value()) {
@@ -129,6 +130,11 @@ struct Globals::GlobalsImpl {
   void vblank(Globals& g)
   {
     if (_max_frames && _frames_count >= *_max_frames) {
+      auto elapsed = bee::Time::now() - _start_time;
+      P("$ frames in $, $ frames/sec",
+        _frames_count,
+        elapsed,
+        _frames_count / elapsed.to_float_seconds());
       throw ExitRequested("Max frames reached");
     }
     ++_frames_count;
@@ -149,9 +155,9 @@ struct Globals::GlobalsImpl {
     if (
       _frames_count >= _skip_to_frame &&
       prev / SpeedScale < _progress_counter / SpeedScale) {
-      auto img = _vdp->render();
+      const auto& frame = _vdp->render();
       if (_display) {
-        _display->update(img);
+        _display->update(frame);
         _wait_frame();
       }
     }
@@ -169,7 +175,7 @@ struct Globals::GlobalsImpl {
     _bus->save_state(writer);
     save_state_gen(g.d, writer);
     save_state_gen(g.a, writer);
-    save_state_gen(g.sr, writer);
+    g.sr.save_state(writer);
   }
 
   void load_state(Globals& g, bee::Reader& reader)
@@ -177,7 +183,7 @@ struct Globals::GlobalsImpl {
     _bus->load_state(reader);
     load_state_gen(g.d, reader);
     load_state_gen(g.a, reader);
-    load_state_gen(g.sr, reader);
+    g.sr.load_state(reader);
   }
 
   const std::shared_ptr<IO> io() const { return _bus; }
@@ -303,6 +309,7 @@ struct Globals::GlobalsImpl {
   chunk_file::ChunkFileWriter::ptr _events_writer;
   chunk_file::ChunkFileReader::ptr _events_reader;
 
+  bee::Time _start_time;
   bee::Time _last_frame;
   double _frame_duration_sum;
   double _frame_duration_weight;
@@ -1,8 +1,11 @@
+#pragma once
+
 #include <array>
 
 #include "generated_intf.hpp"
-#include "io_intf.hpp"
+#include "io.hpp"
 #include "registers.hpp"
+#include "rom.hpp"
 #include "status_register.hpp"
 #include "types.hpp"
 
@@ -14,11 +17,11 @@ struct Globals {
   std::array<DataRegister, 8> d;
   std::array<AddrRegister, 8> a;
   StatusRegister sr;
-  IOIntf::ptr io;
+  IO::ptr io;
 
   struct Args {
     bool verbose;
-    std::string rom_content;
+    Rom::ptr rom;
     std::shared_ptr<GeneratedIntf> generated;
     std::optional<std::string> display;
     std::optional<int64_t> max_frames;
@@ -7,11 +7,10 @@
 #include "generated.hpp"
 #include "globals.hpp"
 #include "manual_functions.hpp"
-#include "parse_spec.hpp"
-#include "to_cpp.hpp"
+#include "parse_cmd.hpp"
+#include "rom.hpp"
 
 #include "bee/file_path.hpp"
-#include "bee/file_reader.hpp"
 #include "bee/file_writer.hpp"
 #include "bee/or_error.hpp"
 #include "bee/print.hpp"
@@ -24,19 +23,8 @@ namespace {
 
 bee::OrError<> disasm_main(const bee::FilePath& rom_filename)
 {
-  bail(content, bee::FileReader::read_file(rom_filename));
-  return Disasm::disasm_and_print(content);
-}
-
-command::Cmd to_cpp_cmd()
-{
-  using namespace command::flags;
-  auto builder = command::CommandBuilder("Convert to cpp");
-  auto filepath = builder.required_anon(FilePath, "FILEPATH", "Rom file");
-  return builder.run([=]() -> bee::OrError<> {
-    bail(content, bee::FileReader::read_file(*filepath));
-    return ToCpp::to_cpp(content);
-  });
+  bail(rom, Rom::open(rom_filename));
+  return Disasm::disasm_and_print(rom);
 }
 
 command::Cmd disasm_cmd()
@@ -60,7 +48,7 @@ auto env_flags(command::CommandBuilder& builder, bool native)
   auto skip_to_frame = builder.optional_with_default("--skip-to-frame", Int, 0);
   auto rom_filename = builder.required_anon(FilePath, "FILEPATH", "Rom file");
   return [=]() -> bee::OrError<bool> {
-    bail(rom_content, bee::FileReader::read_file(*rom_filename));
+    bail(rom, Rom::open(*rom_filename));
     GeneratedIntf::ptr generated;
     if (native) {
       auto manual_functions = ManualFunctions::create(*verbose);
@@ -69,7 +57,7 @@ auto env_flags(command::CommandBuilder& builder, bool native)
     }
     G.init_runtime({
       .verbose = *verbose,
-      .rom_content = rom_content,
+      .rom = rom,
       .generated = generated,
       .display = *display,
       .max_frames = *max_frames,
@@ -110,11 +98,17 @@ command::Cmd emulate_cmd()
   auto show_registers = builder.no_arg("--show-registers");
   auto load_state = builder.optional("--load-state", FilePath);
   auto save_state = builder.optional("--save-state", FilePath);
+  auto micro_ops = builder.no_arg("--micro-ops");
   auto init = env_flags(builder, false);
   return run(builder, [=]() -> bee::OrError<> {
     bail(verbose, init());
     return Emulate::main(
-      *show_registers, verbose, *max_instructions, *load_state, *save_state);
+      *show_registers,
+      verbose,
+      *micro_ops,
+      *max_instructions,
+      *load_state,
+      *save_state);
   });
 }
 
@@ -135,9 +129,8 @@ int main(int argc, char* argv[])
   using namespace command::flags;
   return command::GroupBuilder("Emulator")
     .cmd("emulate", emulate_cmd())
-    .cmd("parse", ParseSpec::cmd())
+    .cmd("parse", ParseCmd::cmd())
     .cmd("disasm", disasm_cmd())
-    .cmd("to-cpp", to_cpp_cmd())
     .cmd("native", native_cmd())
     .build()
     .main(argc, argv);
@@ -10,7 +10,8 @@ constexpr size_t max_line_size = 32;
 
 }
 
-void HexView::print_hex(ulong_t start_address, const std::string& content)
+void HexView::print_hex(
+  ulong_t start_address, std::span<const ubyte_t> content)
 {
   for (int line_num = 0;; line_num++) {
     size_t offset = line_num * max_line_size;
@@ -20,11 +21,11 @@ void HexView::print_hex(ulong_t start_address, const std::string& content)
     for (size_t i = 0; i < max_line_size; i++) {
       auto idx = offset + i;
       if (idx < content.size()) {
-        char c = content[i + offset];
-        left += F("{02x}", uint8_t(c));
+        ubyte_t c = content[i + offset];
+        left += F("{02x}", c);
         left += ' ';
         if (c >= 32 && c < 127) {
-          right += F(c);
+          right += char(c);
         } else {
           right += '.';
         }
@@ -1,13 +1,14 @@
 #pragma once
 
-#include <string>
+#include <span>
 
 #include "types.hpp"
 
 namespace heaven_ice {
 
 struct HexView {
-  static void print_hex(ulong_t start_address, const std::string& content);
+  static void print_hex(
+    ulong_t start_address, std::span<const ubyte_t> content);
 };
 
 } // namespace heaven_ice
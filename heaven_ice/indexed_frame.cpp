@@ -0,0 +1,35 @@
+#include "indexed_frame.hpp"
+
+#include <cstring>
+
+namespace heaven_ice {
+
+IndexedFrame::IndexedFrame()
+{
+  pixels.fill(0);
+  palette.fill(Color{});
+}
+
+std::array<Color, 256> IndexedFrame::colors() const
+{
+  std::array<Color, 256> out;
+  for (int p = 0; p < 256; p++) {
+    out[p] = (p & 0xf) == 0 ? Color{} : palette[p % PALETTE_SIZE];
+  }
+  return out;
+}
+
+pixel::Image IndexedFrame::to_image() const
+{
+  auto table = colors();
+  static_assert(sizeof(Color) == 3);
+  pixel::Image img(Height, Width);
+  ubyte_t* out = img.data();
+  for (ubyte_t p : pixels) {
+    std::memcpy(out, &table[p], sizeof(Color));
+    out += sizeof(Color);
+  }
+  return img;
+}
+
+} // namespace heaven_ice
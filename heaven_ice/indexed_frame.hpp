@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+
+#include "palette.hpp"
+#include "types.hpp"
+
+#include "pixel/image.hpp"
+
+namespace heaven_ice {
+
+// A rendered frame before the palette lookup. Each pixel is a CRAM index,
+// palette * 16 + color, with HighPriority set for high priority pixels. Color
+// 0 is shown black.
+struct IndexedFrame {
+ public:
+  static constexpr int Height = 224;
+  static constexpr int Width = 320;
+
+  static constexpr ubyte_t HighPriority = 0x80;
+
+  IndexedFrame();
+
+  ubyte_t* line(int y) { return pixels.data() + y * Width; }
+
+  // The color of every possible pixel value, so a conversion is one load per
+  // pixel with no masking or branches
+  std::array<Color, 256> colors() const;
+
+  // Converts to 24 bit RGB in a single pass over the pixels
+  pixel::Image to_image() const;
+
+  std::array<ubyte_t, Height * Width> pixels;
+
+  // The colors at the time the frame was rendered
+  Palette palette;
+};
+
+} // namespace heaven_ice
@@ -4,6 +4,7 @@
 #include <type_traits>
 
 #include "bit_manip.hpp"
+#include "condition.hpp"
 #include "globals.hpp"
 #include "size_kind.hpp"
 #include "types.hpp"
@@ -27,13 +28,7 @@ template <class T> bool is_neg(T v) { return make_signed_v<T>(v) < 0; }
 
 } // namespace details
 
-template <class T> void TST(T v)
-{
-  G.sr.set_neg(details::is_neg<T>(v));
-  G.sr.set_zero(v == 0);
-  G.sr.set_ov(false);
-  G.sr.set_carry(false);
-}
+template <class T> void TST(T v) { G.sr.set_tst<T>(v); }
 
 template <class T> T UCC(T v)
 {
@@ -45,19 +40,70 @@ template <class T>
   requires std::is_signed_v<T>
 T CMP(T dst, T src)
 {
-  using U = std::make_unsigned_t<T>;
-
   T res = dst - src;
+  G.sr.set_cmp<T>(dst, src, res);
+  return res;
+}
 
-  bool ov_max = src < 0 && dst > details::maxv<T>() + src;
-  bool ov_min = src > 0 && dst < details::minv<T>() + src;
-
-  G.sr.set_neg(details::is_neg<T>(res));
-  G.sr.set_zero(res == 0);
-  G.sr.set_ov(ov_max || ov_min);
-  G.sr.set_carry(U(dst) < U(src));
+// TST and CMP fused with the branch on their flags that follows, they test the
+// operands directly instead of going through the status register
+template <Condition::Value C, class T>
+  requires std::is_signed_v<T>
+bool TST_CC(T v)
+{
+  if constexpr (C == Condition::EQ || C == Condition::LS) {
+    return v == 0;
+  } else if constexpr (C == Condition::NE || C == Condition::HI) {
+    return v != 0;
+  } else if constexpr (C == Condition::MI || C == Condition::LT) {
+    return v < 0;
+  } else if constexpr (C == Condition::PL || C == Condition::GE) {
+    return v >= 0;
+  } else if constexpr (C == Condition::GT) {
+    return v > 0;
+  } else if constexpr (C == Condition::LE) {
+    return v <= 0;
+  } else if constexpr (C == Condition::CC) {
+    return true;
+  } else if constexpr (C == Condition::CS) {
+    return false;
+  } else {
+    static_assert(false, "Condition not supported");
+  }
+}
 
-  return res;
+template <Condition::Value C, class T>
+  requires std::is_signed_v<T>
+bool CMP_CC(T dst, T src)
+{
+  using U = std::make_unsigned_t<T>;
+  if constexpr (C == Condition::EQ) {
+    return dst == src;
+  } else if constexpr (C == Condition::NE) {
+    return dst != src;
+  } else if constexpr (C == Condition::HI) {
+    return U(dst) > U(src);
+  } else if constexpr (C == Condition::LS) {
+    return U(dst) <= U(src);
+  } else if constexpr (C == Condition::CC) {
+    return U(dst) >= U(src);
+  } else if constexpr (C == Condition::CS) {
+    return U(dst) < U(src);
+  } else if constexpr (C == Condition::GT) {
+    return dst > src;
+  } else if constexpr (C == Condition::GE) {
+    return dst >= src;
+  } else if constexpr (C == Condition::LT) {
+    return dst < src;
+  } else if constexpr (C == Condition::LE) {
+    return dst <= src;
+  } else if constexpr (C == Condition::MI) {
+    return T(dst - src) < 0;
+  } else if constexpr (C == Condition::PL) {
+    return T(dst - src) >= 0;
+  } else {
+    static_assert(false, "Condition not supported");
+  }
 }
 
 template <class T> void BTST(T dst, int bit)
@@ -149,11 +195,7 @@ inline ulong_t SWAP(ulong_t v) { return (v >> 16) | (v << 16); }
 template <class T> T NEG(T v)
 {
   T r = -v;
-  G.sr.set_ext(r != 0);
-  G.sr.set_neg(details::is_neg<T>(r));
-  G.sr.set_zero(r == 0);
-  G.sr.set_ov(false);
-  G.sr.set_carry(r != 0);
+  G.sr.set_flags(r != 0, details::is_neg<T>(r), r == 0, false, r != 0);
   return r;
 }
 
@@ -183,14 +225,11 @@ template <class T> T EOR(T a, T b)
 
 template <class T> T ADD(T a, T b)
 {
-  // TODO: ADDA does not update CC
-  G.sr.invalidate_cc();
   T ret = a + b;
-  G.sr.set_zero(ret == 0);
+  G.sr.set_zero_only<T>(ret);
   return ret;
 }
 
-// TODO: SUBA does not update CC
 template <class T> T SUB(T a, T b) { return CMP<T>(a, b); }
 
 template <class T> T MUL(T a, T b)
@@ -203,14 +242,19 @@ inline ulong_t MULU(uword_t a, uword_t b) { return MUL<ulong_t>(a, b); }
 
 inline slong_t MULS(sword_t a, sword_t b) { return MUL<slong_t>(a, b); }
 
-template <class T> T DIV(T a, T b)
+template <class T> T DIV_NF(T a, T b)
 {
-  G.sr.invalidate_cc();
   T q = a / b;
   T r = a % b;
   return (q & 0xffff) | (r << 16);
 }
 
+template <class T> T DIV(T a, T b)
+{
+  G.sr.invalidate_cc();
+  return DIV_NF<T>(a, b);
+}
+
 inline slong_t DIVS(slong_t a, slong_t b) { return DIV<slong_t>(a, b); }
 
 inline ulong_t DIVU(ulong_t a, ulong_t b) { return DIV<ulong_t>(a, b); }
@@ -265,6 +309,62 @@ template <class T, class U, class V> void EXG(U& r1, V& r2)
   r2.template set<T>(v1);
 }
 
+// Variants of the operations above that don't update the condition codes. The
+// generated code uses them when the flags they would set are never read. They
+// also implement ADDA, SUBA, and ADDQ and SUBQ to an address register, which
+// leave the flags alone.
+
+template <class T> T ADD_NF(T a, T b) { return a + b; }
+template <class T> T SUB_NF(T a, T b) { return a - b; }
+template <class T> T AND_NF(T a, T b) { return a & b; }
+template <class T> T OR_NF(T a, T b) { return a | b; }
+template <class T> T EOR_NF(T a, T b) { return a ^ b; }
+template <class T> T NOT_NF(T v) { return ~v; }
+template <class T> T NEG_NF(T v) { return -v; }
+
+template <class T> T ROR_NF(T v, int bits)
+{
+  using U = std::make_unsigned_t<T>;
+  bits %= 64;
+  return (U(v) >> bits) | (U(v) << (nbits<U>() - bits));
+}
+
+template <class T> T ROL_NF(T v, int bits)
+{
+  using U = std::make_unsigned_t<T>;
+  return (U(v) << bits) | (U(v) >> (nbits<U>() - bits));
+}
+
+template <class T> T ASR_NF(T v, int bits)
+{
+  return std::make_signed_t<T>(v) >> bits;
+}
+
+template <class T> T ASL_NF(T v, int bits)
+{
+  return std::make_signed_t<T>(v) << (bits % 64);
+}
+
+template <class T> T LSR_NF(T v, int bits)
+{
+  return std::make_unsigned_t<T>(v) >> bits;
+}
+
+template <class T> T LSL_NF(T v, int bits)
+{
+  return std::make_unsigned_t<T>(v) << (bits % 64);
+}
+
+template <class T> T BCLR_NF(T v, int bit) { return v & (~(1 << bit)); }
+template <class T> T BSET_NF(T v, int bit) { return v | (1 << bit); }
+template <class T> T BCHG_NF(T v, int bit) { return v ^ (1 << bit); }
+
+inline ulong_t MULU_NF(uword_t a, uword_t b) { return ulong_t(a) * b; }
+inline slong_t MULS_NF(sword_t a, sword_t b) { return slong_t(a) * b; }
+
+inline slong_t DIVS_NF(slong_t a, slong_t b) { return DIV_NF<slong_t>(a, b); }
+inline ulong_t DIVU_NF(ulong_t a, ulong_t b) { return DIV_NF<ulong_t>(a, b); }
+
 template <class T> inline T EXT(prev_size_t<T> v) { return v; }
 
 inline void NOOP() {}
@@ -273,6 +373,15 @@ inline void RTE() {}
 
 template <class T> bool NOT_MINUS_ONE(T v) { return v != -1; }
 
+// Iterations of a DBRA loop entered with the given counter, and the bytes it
+// moves when each one moves a T
+inline ulong_t LOOP_COUNT(sword_t counter) { return uword_t(counter) + 1; }
+
+template <class T> inline ulong_t LOOP_BYTES(sword_t counter)
+{
+  return LOOP_COUNT(counter) * sizeof(T);
+}
+
 using B = sbyte_t;
 using W = sword_t;
 using L = slong_t;
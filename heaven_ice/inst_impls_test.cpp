@@ -84,5 +84,175 @@ TEST(ABCD)
   run_test(0xd4, 0x15);
 }
 
+TEST(flag_free)
+{
+  // Same value as the operation updating the flags, and the flags untouched
+  auto run_test = [](const char* name, auto nf, auto op) {
+    auto expected = op();
+    G.sr.set_from_int(0x15);
+    auto res = nf();
+    P("$ -> $ $ $", name, res, res == expected ? "same" : "different", G.sr);
+  };
+  run_test(
+    "ADD_NF<B>(100, 50)",
+    [] { return ADD_NF<B>(100, 50); },
+    [] { return ADD<B>(100, 50); });
+  run_test(
+    "ADD_NF<L>(-1, 1)",
+    [] { return ADD_NF<L>(-1, 1); },
+    [] { return ADD<L>(-1, 1); });
+  run_test(
+    "SUB_NF<W>(-32768, 1)",
+    [] { return SUB_NF<W>(-32768, 1); },
+    [] { return SUB<W>(-32768, 1); });
+  run_test(
+    "SUB_NF<L>(0, 1)",
+    [] { return SUB_NF<L>(0, 1); },
+    [] { return SUB<L>(0, 1); });
+  run_test(
+    "AND_NF<B>(0x5a, 0x0f)",
+    [] { return AND_NF<B>(0x5a, 0x0f); },
+    [] { return AND<B>(0x5a, 0x0f); });
+  run_test(
+    "OR_NF<W>(0x1200, 0x34)",
+    [] { return OR_NF<W>(0x1200, 0x34); },
+    [] { return OR<W>(0x1200, 0x34); });
+  run_test(
+    "EOR_NF<L>(-1, 0xff)",
+    [] { return EOR_NF<L>(-1, 0xff); },
+    [] { return EOR<L>(-1, 0xff); });
+  run_test(
+    "NOT_NF<B>(0x0f)",
+    [] { return NOT_NF<B>(0x0f); },
+    [] { return NOT<B>(0x0f); });
+  run_test(
+    "NEG_NF<W>(5)", [] { return NEG_NF<W>(5); }, [] { return NEG<W>(5); });
+  run_test(
+    "ROR_NF<W>(0xfffa, 4)",
+    [] { return ROR_NF<W>(0xfffa, 4); },
+    [] { return ROR<W>(0xfffa, 4); });
+  run_test(
+    "ROL_NF<B>(0x81, 1)",
+    [] { return ROL_NF<B>(0x81, 1); },
+    [] { return ROL<B>(0x81, 1); });
+  run_test(
+    "ASR_NF<W>(-4, 1)",
+    [] { return ASR_NF<W>(-4, 1); },
+    [] { return ASR<W>(-4, 1); });
+  run_test(
+    "ASL_NF<B>(0x41, 1)",
+    [] { return ASL_NF<B>(0x41, 1); },
+    [] { return ASL<B>(0x41, 1); });
+  run_test(
+    "LSR_NF<B>(-128, 3)",
+    [] { return LSR_NF<B>(-128, 3); },
+    [] { return LSR<B>(-128, 3); });
+  run_test(
+    "LSL_NF<L>(0x40000001, 2)",
+    [] { return LSL_NF<L>(0x40000001, 2); },
+    [] { return LSL<L>(0x40000001, 2); });
+  run_test(
+    "BCLR_NF<B>(0x7f, 3)",
+    [] { return BCLR_NF<B>(0x7f, 3); },
+    [] { return BCLR<B>(0x7f, 3); });
+  run_test(
+    "BSET_NF<B>(0, 7)",
+    [] { return BSET_NF<B>(0, 7); },
+    [] { return BSET<B>(0, 7); });
+  run_test(
+    "BCHG_NF<W>(0x100, 8)",
+    [] { return BCHG_NF<W>(0x100, 8); },
+    [] { return BCHG<W>(0x100, 8); });
+  run_test(
+    "MULU_NF(300, 300)",
+    [] { return MULU_NF(300, 300); },
+    [] { return MULU(300, 300); });
+  run_test(
+    "MULS_NF(-3, 7)",
+    [] { return MULS_NF(-3, 7); },
+    [] { return MULS(-3, 7); });
+  run_test(
+    "DIVS_NF(-7, 2)",
+    [] { return DIVS_NF(-7, 2); },
+    [] { return DIVS(-7, 2); });
+  run_test(
+    "DIVU_NF(100000, 7)",
+    [] { return DIVU_NF(100000, 7); },
+    [] { return DIVU(100000, 7); });
+}
+
+// A condition evaluated from the flags in the status register
+bool flags_condition(Condition cond)
+{
+  bool n = G.sr.neg();
+  bool z = G.sr.zero();
+  bool v = G.sr.ov();
+  bool c = G.sr.carry();
+  switch (cond) {
+  case Condition::HI:
+    return !c && !z;
+  case Condition::LS:
+    return c || z;
+  case Condition::CC:
+    return !c;
+  case Condition::CS:
+    return c;
+  case Condition::NE:
+    return !z;
+  case Condition::EQ:
+    return z;
+  case Condition::PL:
+    return !n;
+  case Condition::MI:
+    return n;
+  case Condition::GE:
+    return n == v;
+  case Condition::LT:
+    return n != v;
+  case Condition::GT:
+    return !z && n == v;
+  case Condition::LE:
+    return z || n != v;
+  default:
+    raise_error("Condition not supported: $", cond);
+  }
+}
+
+// Compares the fused tests with the flags TST and CMP set, for every byte
+// operand
+template <Condition::Value C> void check_fused_cc()
+{
+  int tst_mismatches = 0;
+  int cmp_mismatches = 0;
+  for (int a = -128; a < 128; a++) {
+    TST<B>(a);
+    if (TST_CC<C, B>(a) != flags_condition(C)) { tst_mismatches++; }
+    for (int b = -128; b < 128; b++) {
+      CMP<B>(a, b);
+      if (CMP_CC<C, B>(a, b) != flags_condition(C)) { cmp_mismatches++; }
+    }
+  }
+  P("$: TST_CC mismatches: $ CMP_CC mismatches: $",
+    Condition(C),
+    tst_mismatches,
+    cmp_mismatches);
+}
+
+TEST(fused_cc)
+{
+  check_fused_cc<Condition::HI>();
+  check_fused_cc<Condition::LS>();
+  check_fused_cc<Condition::CC>();
+  check_fused_cc<Condition::CS>();
+  check_fused_cc<Condition::NE>();
+  check_fused_cc<Condition::EQ>();
+  check_fused_cc<Condition::PL>();
+  check_fused_cc<Condition::MI>();
+  check_fused_cc<Condition::GE>();
+  check_fused_cc<Condition::LT>();
+  check_fused_cc<Condition::GT>();
+  check_fused_cc<Condition::LE>();
+}
+
 } // namespace
 } // namespace heaven_ice
@@ -63,4 +63,19 @@ bool Instruction::is_fn_call() const
   }
 }
 
+bool Instruction::is_addr_reg_update() const
+{
+  switch (name) {
+  case InstEnum::ADDA:
+  case InstEnum::SUBA:
+    return true;
+  case InstEnum::ADDQ:
+  case InstEnum::SUBQ:
+  case InstEnum::MOVE:
+    return dst.has_value() && dst->is_addr_reg();
+  default:
+    return false;
+  }
+}
+
 } // namespace heaven_ice
@@ -31,6 +31,10 @@ struct Instruction {
 
   bool is_fn_call() const;
 
+  // ADDA, SUBA, and ADDQ, SUBQ or MOVE to an address register. These leave
+  // the condition codes alone.
+  bool is_addr_reg_update() const;
+
   std::optional<ulong_t> jump_addr() const;
 };
 
@@ -1,5 +1,7 @@
 #include "io.hpp"
 
+#include <algorithm>
+
 #include "magic_constants.hpp"
 
 #include "bee/print.hpp"
@@ -7,8 +9,6 @@
 namespace heaven_ice {
 namespace {
 
-constexpr ulong_t ADDR_MASK = 0xffffff;
-
 inline bool in_ranges(ulong_t addr, ulong_t begin, ulong_t size)
 {
   return addr >= begin && addr < begin + size;
@@ -23,52 +23,101 @@ inline bool in_range(ulong_t addr, ulong_t begin, ulong_t end)
 
 IO::IO(
   bool verbose,
-  const IOIntf::ptr& ram,
-  const IOIntf::ptr& rom,
+  const Memory::ptr& ram,
+  const Memory::ptr& rom,
   const IOIntf::ptr& vdp,
   const IOIntf::ptr& controller)
     : _ram(ram),
       _rom(rom),
       _vdp(vdp),
       _controller(controller),
+      _ram_data(ram->mutable_data()),
       _verbose(verbose)
-{}
+{
+  if (!_verbose) { _map_pages(); }
+}
 
 IO::~IO() {}
 
-template <class T> T IO::_read(ulong_t addr_orig)
+void IO::_map_pages()
+{
+  // Only pages fully covered by the ROM are mapped, a partial last page is
+  // left to the device path so out of bounds reads still fail
+  for (ulong_t page = 0; page < ROM_END / PageSize; page++) {
+    if ((page + 1) * PageSize > _rom->size()) { break; }
+    _pages[page].read = _rom->data() + page * PageSize;
+  }
+  for (ulong_t addr = RAM_BEGIN; addr < RAM_END; addr += PageSize) {
+    auto& page = _pages[addr >> PageBits];
+    page.write = _ram_data + (addr - RAM_BEGIN);
+    page.read = page.write;
+  }
+}
+
+const ubyte_t* IO::_host_read(ulong_t addr, ulong_t bytes) const
+{
+  if (auto p = _host_write(addr, bytes); p != nullptr) { return p; }
+  ulong_t masked = addr & AddrMask;
+  ulong_t rom_end = std::min<ulong_t>(_rom->size(), ROM_END);
+  if (_verbose || masked + bytes > rom_end) { return nullptr; }
+  return _rom->data() + masked;
+}
+
+ubyte_t* IO::_host_write(ulong_t addr, ulong_t bytes) const
+{
+  ulong_t masked = addr & AddrMask;
+  if (_verbose || !in_range(masked, RAM_BEGIN, RAM_END)) { return nullptr; }
+  if (masked + bytes > RAM_END) { return nullptr; }
+  return _ram_data + (masked - RAM_BEGIN);
+}
+
+template <class T> T IO::_read_slow(ulong_t addr)
 {
-  auto ret = [&]() -> T {
-    ulong_t addr = addr_orig & ADDR_MASK;
-    if (in_ranges(addr, Z80_BUS_REQUEST, 2)) {
-      return 0;
-    } else if (in_range(addr, VDP_BEGIN, VDP_END)) {
-      return _vdp->read<T>(addr);
-    } else if (addr == VERSION_REGISTER) {
-      return 0x81;
-    } else if (in_range(addr, CTRL_BEGIN, CTRL_END)) {
-      return _controller->read<T>(addr);
-    } else if (addr < ROM_END) {
-      return _rom->read<T>(addr);
-    } else if (in_range(addr, RAM_BEGIN, RAM_END)) {
-      return _ram->read<T>(addr - RAM_BEGIN);
-    } else if (in_range(addr, Z80_RAM_BEGIN, Z80_RAM_END)) {
-      // Z80 ram, ignore
-      return 0;
-    } else {
-      raise_error("Unsupported read address: {x}", addr);
-    }
-  }();
+  T ret = _read_device<T>(addr & AddrMask);
   if (_verbose)
-    P("({06x}).$ -> #{x}", addr_orig, SizeKind::of_type<T>().to_string(), ret);
+    P("({06x}).$ -> #{x}", addr, SizeKind::of_type<T>().to_string(), ret);
   return ret;
 }
 
-template <class T> void IO::_write(ulong_t addr, T v)
+template <class T> void IO::_write_slow(ulong_t addr, T v)
 {
   if (_verbose)
     P("({06x}).$ <- #{x}", addr, SizeKind::of_type<T>().to_string(), v);
-  addr &= ADDR_MASK;
+  _write_device<T>(addr & AddrMask, v);
+}
+
+template ubyte_t IO::_read_slow<ubyte_t>(ulong_t addr);
+template uword_t IO::_read_slow<uword_t>(ulong_t addr);
+template ulong_t IO::_read_slow<ulong_t>(ulong_t addr);
+
+template void IO::_write_slow<ubyte_t>(ulong_t addr, ubyte_t v);
+template void IO::_write_slow<uword_t>(ulong_t addr, uword_t v);
+template void IO::_write_slow<ulong_t>(ulong_t addr, ulong_t v);
+
+template <class T> T IO::_read_device(ulong_t addr)
+{
+  if (in_ranges(addr, Z80_BUS_REQUEST, 2)) {
+    return 0;
+  } else if (in_range(addr, VDP_BEGIN, VDP_END)) {
+    return _vdp->read<T>(addr);
+  } else if (addr == VERSION_REGISTER) {
+    return 0x81;
+  } else if (in_range(addr, CTRL_BEGIN, CTRL_END)) {
+    return _controller->read<T>(addr);
+  } else if (addr < ROM_END) {
+    return _rom->read<T>(addr);
+  } else if (in_range(addr, RAM_BEGIN, RAM_END)) {
+    return _ram->read<T>(addr - RAM_BEGIN);
+  } else if (in_range(addr, Z80_RAM_BEGIN, Z80_RAM_END)) {
+    // Z80 ram, ignore
+    return 0;
+  } else {
+    raise_error("Unsupported read address: {x}", addr);
+  }
+}
+
+template <class T> void IO::_write_device(ulong_t addr, T v)
+{
   if (in_range(addr, VDP_BEGIN, VDP_END)) {
     _vdp->write<T>(addr, v);
   } else if (in_range(addr, RAM_BEGIN, RAM_END)) {
@@ -88,13 +137,13 @@ template <class T> void IO::_write(ulong_t addr, T v)
   }
 }
 
-ubyte_t IO::_b(ulong_t addr) { return _read<ubyte_t>(addr); }
-uword_t IO::_w(ulong_t addr) { return _read<uword_t>(addr); }
-ulong_t IO::_l(ulong_t addr) { return _read<ulong_t>(addr); }
+ubyte_t IO::_b(ulong_t addr) { return read<ubyte_t>(addr); }
+uword_t IO::_w(ulong_t addr) { return read<uword_t>(addr); }
+ulong_t IO::_l(ulong_t addr) { return read<ulong_t>(addr); }
 
-void IO::_b(ulong_t addr, ubyte_t v) { _write<ubyte_t>(addr, v); }
-void IO::_w(ulong_t addr, uword_t v) { _write<uword_t>(addr, v); }
-void IO::_l(ulong_t addr, ulong_t v) { _write<ulong_t>(addr, v); }
+void IO::_b(ulong_t addr, ubyte_t v) { write<ubyte_t>(addr, v); }
+void IO::_w(ulong_t addr, uword_t v) { write<uword_t>(addr, v); }
+void IO::_l(ulong_t addr, ulong_t v) { write<ulong_t>(addr, v); }
 
 void IO::save_state(bee::Writer& writer)
 {
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <array>
+#include <cstring>
 #include <exception>
 #include <memory>
+#include <type_traits>
 
+#include "big_endian.hpp"
 #include "io_intf.hpp"
+#include "magic_constants.hpp"
+#include "memory.hpp"
+#include "size_kind.hpp"
 #include "types.hpp"
 
 namespace heaven_ice {
@@ -14,8 +21,8 @@ struct IO final : public IOIntf {
 
   IO(
     bool verbose,
-    const IOIntf::ptr& ram,
-    const IOIntf::ptr& rom,
+    const Memory::ptr& ram,
+    const Memory::ptr& rom,
     const IOIntf::ptr& vdp,
     const IOIntf::ptr& controller);
   ~IO();
@@ -23,9 +30,294 @@ struct IO final : public IOIntf {
   void save_state(bee::Writer& writer) override;
   void load_state(bee::Reader& reader) override;
 
+  // These hide the IOIntf accessors so code holding the concrete type, like
+  // everything going through G.io, gets the page table lookup inlined. The
+  // virtual interface is still there for code holding an IOIntf::ptr.
+  template <class T> inline T read(ulong_t addr)
+  {
+    using U = std::make_unsigned_t<T>;
+    ulong_t masked = addr & AddrMask;
+    ulong_t offset = masked & (PageSize - 1);
+    const auto& page = _pages[masked >> PageBits];
+    if (page.read != nullptr && offset <= PageSize - sizeof(U)) [[likely]] {
+      return load_be<U>(page.read + offset);
+    }
+    return _read_slow<U>(addr);
+  }
+
+  template <class T> inline void write(ulong_t addr, T v)
+  {
+    using U = std::make_unsigned_t<T>;
+    ulong_t masked = addr & AddrMask;
+    ulong_t offset = masked & (PageSize - 1);
+    const auto& page = _pages[masked >> PageBits];
+    if (page.write != nullptr && offset <= PageSize - sizeof(U)) [[likely]] {
+      store_be<U>(page.write + offset, v);
+      return;
+    }
+    _write_slow<U>(addr, v);
+  }
+
+  inline sbyte_t b(ulong_t addr) { return read<sbyte_t>(addr); }
+  inline sword_t w(ulong_t addr) { return read<sword_t>(addr); }
+  inline slong_t l(ulong_t addr) { return read<slong_t>(addr); }
+  inline ubyte_t ub(ulong_t addr) { return read<ubyte_t>(addr); }
+  inline uword_t uw(ulong_t addr) { return read<uword_t>(addr); }
+  inline ulong_t ul(ulong_t addr) { return read<ulong_t>(addr); }
+
+  inline void b(ulong_t addr, sbyte_t v) { write<sbyte_t>(addr, v); }
+  inline void w(ulong_t addr, sword_t v) { write<sword_t>(addr, v); }
+  inline void l(ulong_t addr, slong_t v) { write<slong_t>(addr, v); }
+  inline void ub(ulong_t addr, ubyte_t v) { write<ubyte_t>(addr, v); }
+  inline void uw(ulong_t addr, uword_t v) { write<uword_t>(addr, v); }
+  inline void ul(ulong_t addr, ulong_t v) { write<ulong_t>(addr, v); }
+
+  // Accessors for addresses known to belong to a device, the generated code
+  // uses them for constant addresses to skip the address decoding. The
+  // verbose variant of the generated code passes Verbose so they still go
+  // through the logging path, the other one has no check left.
+  template <class T, bool Verbose> inline T ram(ulong_t addr)
+  {
+    using U = std::make_unsigned_t<T>;
+    if constexpr (Verbose) { return _read_slow<U>(addr); }
+    return load_be<U>(_ram_data + ((addr & AddrMask) - RAM_BEGIN));
+  }
+
+  template <class T, bool Verbose> inline void ram(ulong_t addr, T v)
+  {
+    using U = std::make_unsigned_t<T>;
+    if constexpr (Verbose) {
+      _write_slow<U>(addr, v);
+    } else {
+      store_be<U>(_ram_data + ((addr & AddrMask) - RAM_BEGIN), v);
+    }
+  }
+
+  template <class T, bool Verbose> inline T vdp(ulong_t addr)
+  {
+    using U = std::make_unsigned_t<T>;
+    if constexpr (Verbose) { return _read_slow<U>(addr); }
+    return _vdp->read<U>(addr & AddrMask);
+  }
+
+  template <class T, bool Verbose> inline void vdp(ulong_t addr, T v)
+  {
+    using U = std::make_unsigned_t<T>;
+    if constexpr (Verbose) {
+      _write_slow<U>(addr, v);
+    } else {
+      _vdp->write<U>(addr & AddrMask, v);
+    }
+  }
+
+  template <class T, bool Verbose> inline T ctrl(ulong_t addr)
+  {
+    using U = std::make_unsigned_t<T>;
+    if constexpr (Verbose) { return _read_slow<U>(addr); }
+    return _controller->read<U>(addr & AddrMask);
+  }
+
+  template <class T, bool Verbose> inline void ctrl(ulong_t addr, T v)
+  {
+    using U = std::make_unsigned_t<T>;
+    if constexpr (Verbose) {
+      _write_slow<U>(addr, v);
+    } else {
+      _controller->write<U>(addr & AddrMask, v);
+    }
+  }
+
+  inline slong_t read_signed(SizeKind size, ulong_t addr)
+  {
+    switch (size) {
+    case SizeKind::Byte:
+      return b(addr);
+    case SizeKind::Word:
+      return w(addr);
+    case SizeKind::Long:
+      return l(addr);
+    }
+  }
+
+  inline void write_signed(SizeKind size, ulong_t addr, slong_t v)
+  {
+    switch (size) {
+    case SizeKind::Byte:
+      b(addr, v);
+      break;
+    case SizeKind::Word:
+      w(addr, v);
+      break;
+    case SizeKind::Long:
+      l(addr, v);
+      break;
+    }
+  }
+
+  // Range operations for block moves. They resolve the host memory once for
+  // the whole range when it's all in RAM (or ROM for reads), otherwise they do
+  // one bus access per element, which is also what happens in verbose mode.
+
+  template <class T> void read_block(ulong_t addr, slong_t* out, int count)
+  {
+    using U = std::make_unsigned_t<T>;
+    if (auto p = _host_read(addr, count * sizeof(U)); p != nullptr) {
+      for (int i = 0; i < count; i++) {
+        out[i] = T(load_be<U>(p + i * sizeof(U)));
+      }
+      return;
+    }
+    for (int i = 0; i < count; i++) { out[i] = read<T>(addr + i * sizeof(U)); }
+  }
+
+  template <class T>
+  void write_block(ulong_t addr, const slong_t* values, int count)
+  {
+    using U = std::make_unsigned_t<T>;
+    if (auto p = _host_write(addr, count * sizeof(U)); p != nullptr) {
+      for (int i = 0; i < count; i++) {
+        store_be<U>(p + i * sizeof(U), values[i]);
+      }
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      write<U>(addr + i * sizeof(U), values[i]);
+    }
+  }
+
+  template <class T, class... V> void write_regs(ulong_t addr, V... values)
+  {
+    const slong_t block[] = {slong_t(values)...};
+    write_block<T>(addr, block, sizeof...(V));
+  }
+
+  void read_signed_block(SizeKind size, ulong_t addr, slong_t* out, int count)
+  {
+    switch (size) {
+    case SizeKind::Byte:
+      read_block<sbyte_t>(addr, out, count);
+      break;
+    case SizeKind::Word:
+      read_block<sword_t>(addr, out, count);
+      break;
+    case SizeKind::Long:
+      read_block<slong_t>(addr, out, count);
+      break;
+    }
+  }
+
+  void write_signed_block(
+    SizeKind size, ulong_t addr, const slong_t* values, int count)
+  {
+    switch (size) {
+    case SizeKind::Byte:
+      write_block<sbyte_t>(addr, values, count);
+      break;
+    case SizeKind::Word:
+      write_block<sword_t>(addr, values, count);
+      break;
+    case SizeKind::Long:
+      write_block<slong_t>(addr, values, count);
+      break;
+    }
+  }
+
+  // Same as count moves of a T from src to dst, both going up
+  template <class T> void copy(ulong_t dst, ulong_t src, ulong_t count)
+  {
+    using U = std::make_unsigned_t<T>;
+    ulong_t bytes = count * sizeof(U);
+    auto from = _host_read(src, bytes);
+    auto to = _host_write(dst, bytes);
+    // Moving forward onto a later part of the source repeats the start of it,
+    // which memmove doesn't do
+    ulong_t offset = (dst - src) & AddrMask;
+    if (from != nullptr && to != nullptr && (offset == 0 || offset >= bytes)) {
+      std::memmove(to, from, bytes);
+      return;
+    }
+    for (ulong_t i = 0; i < count; i++) {
+      write<U>(dst + i * sizeof(U), read<U>(src + i * sizeof(U)));
+    }
+  }
+
+  template <class T> void fill(ulong_t dst, T value, ulong_t count)
+  {
+    using U = std::make_unsigned_t<T>;
+    if (auto p = _host_write(dst, count * sizeof(U)); p != nullptr) {
+      for (ulong_t i = 0; i < count; i++) {
+        store_be<U>(p + i * sizeof(U), value);
+      }
+      return;
+    }
+    for (ulong_t i = 0; i < count; i++) {
+      write<U>(dst + i * sizeof(U), value);
+    }
+  }
+
+  // Writes count values read going up from src to the same port, like a burst
+  // of data to the VDP
+  template <class T> void write_port(ulong_t port, ulong_t src, ulong_t count)
+  {
+    using U = std::make_unsigned_t<T>;
+    auto from = _host_read(src, count * sizeof(U));
+    if (from != nullptr && _is_vdp_port(port)) {
+      for (ulong_t i = 0; i < count; i++) {
+        _vdp->write<U>(port & AddrMask, load_be<U>(from + i * sizeof(U)));
+      }
+      return;
+    }
+    for (ulong_t i = 0; i < count; i++) {
+      write<U>(port, read<U>(src + i * sizeof(U)));
+    }
+  }
+
+  template <class T> void fill_port(ulong_t port, T value, ulong_t count)
+  {
+    using U = std::make_unsigned_t<T>;
+    if (_is_vdp_port(port)) {
+      for (ulong_t i = 0; i < count; i++) {
+        _vdp->write<U>(port & AddrMask, value);
+      }
+      return;
+    }
+    for (ulong_t i = 0; i < count; i++) { write<U>(port, value); }
+  }
+
  private:
-  template <class T> T _read(ulong_t addr);
-  template <class T> void _write(ulong_t addr, T v);
+  static constexpr ulong_t AddrMask = 0xffffff;
+
+  // The 24 bit address space is split in 256 pages of 64KB. Pages backed by
+  // ROM or RAM point directly into host memory, everything else goes through
+  // the device handlers. No pages are mapped in verbose mode so that every
+  // access is logged.
+  static constexpr int PageBits = 16;
+  static constexpr ulong_t PageSize = 1 << PageBits;
+  static constexpr int NumPages = 256;
+
+  struct Page {
+    const ubyte_t* read = nullptr;
+    ubyte_t* write = nullptr;
+  };
+
+  void _map_pages();
+
+  // Host memory backing the whole range, or nullptr if some of it isn't RAM
+  // (or ROM for reads) or in verbose mode
+  const ubyte_t* _host_read(ulong_t addr, ulong_t bytes) const;
+  ubyte_t* _host_write(ulong_t addr, ulong_t bytes) const;
+
+  bool _is_vdp_port(ulong_t addr) const
+  {
+    ulong_t masked = addr & AddrMask;
+    return !_verbose && masked >= VDP_BEGIN && masked < VDP_END;
+  }
+
+  template <class T> T _read_slow(ulong_t addr);
+  template <class T> void _write_slow(ulong_t addr, T v);
+
+  template <class T> T _read_device(ulong_t addr);
+  template <class T> void _write_device(ulong_t addr, T v);
 
   ubyte_t _b(ulong_t addr) override;
   uword_t _w(ulong_t addr) override;
@@ -35,11 +327,15 @@ struct IO final : public IOIntf {
   void _w(ulong_t addr, uword_t v) override;
   void _l(ulong_t addr, ulong_t v) override;
 
-  IOIntf::ptr _ram;
-  IOIntf::ptr _rom;
+  Memory::ptr _ram;
+  Memory::ptr _rom;
   IOIntf::ptr _vdp;
   IOIntf::ptr _controller;
 
+  ubyte_t* _ram_data;
+
+  std::array<Page, NumPages> _pages;
+
   bool _verbose;
 };
 
@@ -16,6 +16,9 @@ struct DMARequest {
   ulong_t src_addr;
 };
 
+// Tracing is a template parameter so the non verbose variant has no logging
+// left in it at all
+template <bool Verbose>
 struct ManualFunctionsImpl final : public ManualFunctions {
   ~ManualFunctionsImpl() {}
 
@@ -695,19 +698,18 @@ struct ManualFunctionsImpl final : public ManualFunctions {
     _log_ret(__func__);
   }
 
-  ManualFunctionsImpl(bool v) : _v(v) {}
+  ManualFunctionsImpl() {}
 
  private:
   void _log_call(const char* n) const
   {
-    if (_v) P("Call $", n);
+    if constexpr (Verbose) P("Call $", n);
   }
   void _log_ret(const char* n) const
   {
-    if (_v) P("Returned $", n);
+    if constexpr (Verbose) P("Returned $", n);
   }
   GeneratedIntf::ptr _g;
-  bool _v;
 
   std::vector<DMARequest> _dma_queue;
 };
@@ -718,7 +720,11 @@ ManualFunctions::~ManualFunctions() {}
 
 ManualFunctions::ptr ManualFunctions::create(bool verbose)
 {
-  return std::make_shared<ManualFunctionsImpl>(verbose);
+  if (verbose) {
+    return std::make_shared<ManualFunctionsImpl<true>>();
+  } else {
+    return std::make_shared<ManualFunctionsImpl<false>>();
+  }
 }
 
 } // namespace heaven_ice
@@ -1,70 +1,92 @@
 #include "memory.hpp"
 
+#include "big_endian.hpp"
 #include "magic_constants.hpp"
 
 namespace heaven_ice {
 
-Memory::Memory(size_t size) : _mem(size, 0) {}
-Memory::Memory(const std::string& content) { load_rom(content); }
+Memory::Memory(size_t size)
+    : _owned(size, 0),
+      _data(_owned.data()),
+      _mutable_data(_owned.data()),
+      _size(size)
+{}
+
+Memory::Memory(const Rom::ptr& rom)
+    : _rom(rom),
+      _data(rom->data().data()),
+      _mutable_data(nullptr),
+      _size(rom->size())
+{}
 
 Memory::~Memory() {}
 
-void Memory::load_rom(const std::string& rom_content)
+void Memory::_check_range(ulong_t addr, ulong_t bytes) const
 {
-  _mem.resize(rom_content.size());
-  for (ulong_t i = 0; i < rom_content.size(); i++) { _mem[i] = rom_content[i]; }
+  if (size_t(addr) + bytes > size()) [[unlikely]] {
+    raise_error("Memory access out of bounds: {x} >= {x}", addr, size());
+  }
 }
 
-ubyte_t Memory::_b(ulong_t addr)
+void Memory::_check_write(ulong_t addr, ulong_t bytes) const
 {
-  if (addr >= size()) {
-    raise_error("Memory access out of bounds: {x} >= {x}", addr, size());
+  _check_range(addr, bytes);
+  if (_mutable_data == nullptr) [[unlikely]] {
+    raise_error("Write to read only memory: {x}", addr);
   }
-  return _mem.at(addr);
+}
+
+ubyte_t Memory::_b(ulong_t addr)
+{
+  _check_range(addr, 1);
+  return _data[addr];
 }
 
 uword_t Memory::_w(ulong_t addr)
 {
-  return (uword_t(_b(addr)) << 8) | uword_t(_b(addr + 1));
+  _check_range(addr, 2);
+  return load_be<uword_t>(_data + addr);
 }
 
 ulong_t Memory::_l(ulong_t addr)
 {
-  return (ulong_t(_w(addr)) << 16) | ulong_t(_w(addr + 2));
+  _check_range(addr, 4);
+  return load_be<ulong_t>(_data + addr);
 }
 
 void Memory::_b(ulong_t addr, ubyte_t v)
 {
-  if (addr >= size()) {
-    raise_error("Memory access out of bounds: {x} >= {x}", addr, size());
-  }
-  _mem.at(addr) = v;
+  _check_write(addr, 1);
+  _mutable_data[addr] = v;
 }
 
 void Memory::_w(ulong_t addr, uword_t v)
 {
-  _b(addr, v >> 8);
-  _b(addr + 1, v);
+  _check_write(addr, 2);
+  store_be<uword_t>(_mutable_data + addr, v);
 }
 
 void Memory::_l(ulong_t addr, ulong_t v)
 {
-  _w(addr, v >> 16);
-  _w(addr + 2, v);
+  _check_write(addr, 4);
+  store_be<ulong_t>(_mutable_data + addr, v);
 }
 
-size_t Memory::size() const { return _mem.size(); }
+size_t Memory::size() const { return _size; }
+
+const ubyte_t* Memory::data() const { return _data; }
+
+ubyte_t* Memory::mutable_data() { return _mutable_data; }
 
 void Memory::save_state(bee::Writer& writer)
 {
-  must_unit(
-    writer.write(reinterpret_cast<const std::byte*>(_mem.data()), _mem.size()));
+  must_unit(writer.write(reinterpret_cast<const std::byte*>(_data), _size));
 }
 
 void Memory::load_state(bee::Reader& reader)
 {
-  must_unit(
-    reader.read(reinterpret_cast<std::byte*>(_mem.data()), _mem.size()));
+  _check_write(0, _size);
+  must_unit(reader.read(reinterpret_cast<std::byte*>(_mutable_data), _size));
 }
 
 } // namespace heaven_ice
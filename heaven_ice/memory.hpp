@@ -1,10 +1,12 @@
 #pragma once
 
 #include <array>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "io_intf.hpp"
+#include "rom.hpp"
 #include "size_kind.hpp"
 #include "types.hpp"
 
@@ -12,14 +14,23 @@ namespace heaven_ice {
 
 struct Memory final : public IOIntf {
  public:
+  using ptr = std::shared_ptr<Memory>;
+
+  // Zero initialized writable memory
   Memory(size_t size);
-  Memory(const std::string& content);
-  virtual ~Memory();
 
-  void load_rom(const std::string& rom_content);
+  // Read only view of the rom, no copy is made
+  Memory(const Rom::ptr& rom);
+
+  virtual ~Memory();
 
   size_t size() const;
 
+  // Raw host memory, used by the bus to access it directly. mutable_data is
+  // nullptr for read only memory.
+  const ubyte_t* data() const;
+  ubyte_t* mutable_data();
+
   void save_state(bee::Writer&) override;
   void load_state(bee::Reader&) override;
 
@@ -32,7 +43,15 @@ struct Memory final : public IOIntf {
   void _w(ulong_t addr, uword_t v) override;
   void _l(ulong_t addr, ulong_t v) override;
 
-  std::vector<ubyte_t> _mem;
+  void _check_range(ulong_t addr, ulong_t bytes) const;
+  void _check_write(ulong_t addr, ulong_t bytes) const;
+
+  std::vector<ubyte_t> _owned;
+  Rom::ptr _rom;
+
+  const ubyte_t* _data;
+  ubyte_t* _mutable_data;
+  size_t _size;
 };
 
 } // namespace heaven_ice
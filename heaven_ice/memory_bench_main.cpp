@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "memory.hpp"
+
+#include "bee/print.hpp"
+#include "bee/time.hpp"
+
+namespace heaven_ice {
+namespace {
+
+constexpr ulong_t MemSize = 0x10000;
+constexpr int Rounds = 256;
+
+// What Memory used to do, every wide access is built from bounds checked
+// single byte accesses
+struct BytewiseMemory final : public IOIntf {
+ public:
+  BytewiseMemory(size_t size) : _mem(size, 0) {}
+
+  void save_state(bee::Writer&) override {}
+  void load_state(bee::Reader&) override {}
+
+ private:
+  ubyte_t _b(ulong_t addr) override
+  {
+    if (addr >= _mem.size()) {
+      raise_error("Memory access out of bounds: {x}", addr);
+    }
+    return _mem.at(addr);
+  }
+  uword_t _w(ulong_t addr) override
+  {
+    return (uword_t(_b(addr)) << 8) | uword_t(_b(addr + 1));
+  }
+  ulong_t _l(ulong_t addr) override
+  {
+    return (ulong_t(_w(addr)) << 16) | ulong_t(_w(addr + 2));
+  }
+
+  void _b(ulong_t addr, ubyte_t v) override
+  {
+    if (addr >= _mem.size()) {
+      raise_error("Memory access out of bounds: {x}", addr);
+    }
+    _mem.at(addr) = v;
+  }
+  void _w(ulong_t addr, uword_t v) override
+  {
+    _b(addr, v >> 8);
+    _b(addr + 1, v);
+  }
+  void _l(ulong_t addr, ulong_t v) override
+  {
+    _w(addr, v >> 16);
+    _w(addr + 2, v);
+  }
+
+  std::vector<ubyte_t> _mem;
+};
+
+template <class T>
+void run_bench(const char* name, IOIntf& mem, const std::vector<ulong_t>& addrs)
+{
+  ulong_t sum = 0;
+  auto start = bee::Time::now();
+  for (int r = 0; r < Rounds; r++) {
+    for (ulong_t addr : addrs) {
+      mem.write<T>(addr, T(sum + addr));
+      sum += mem.read<T>(addr);
+    }
+  }
+  auto elapsed = bee::Time::now() - start;
+  double ns =
+    elapsed.to_float_seconds() * 1e9 / (double(Rounds) * addrs.size());
+  P("$: $ ns/access (checksum {x})", name, ns, sum);
+}
+
+template <class T> void run_pattern(const char* pattern, bool random)
+{
+  std::vector<ulong_t> addrs;
+  for (ulong_t addr = 0; addr + sizeof(T) <= MemSize; addr += sizeof(T)) {
+    addrs.push_back(addr);
+  }
+  if (random) {
+    std::mt19937 gen(42);
+    std::shuffle(addrs.begin(), addrs.end(), gen);
+  }
+
+  BytewiseMemory bytewise(MemSize);
+  Memory memory(MemSize);
+  P("$ $-bit:", pattern, sizeof(T) * 8);
+  run_bench<T>("  bytewise", bytewise, addrs);
+  run_bench<T>("  bswap   ", memory, addrs);
+}
+
+int main()
+{
+  run_pattern<uword_t>("sequential", false);
+  run_pattern<ulong_t>("sequential", false);
+  run_pattern<uword_t>("random", true);
+  run_pattern<ulong_t>("random", true);
+  return 0;
+}
+
+} // namespace
+} // namespace heaven_ice
+
+int main() { return heaven_ice::main(); }
@@ -0,0 +1,602 @@
+#include "micro_op.hpp"
+
+#include "globals.hpp"
+#include "inst_enum.hpp"
+#include "inst_impls.hpp"
+
+#include "bee/print.hpp"
+
+namespace heaven_ice {
+
+////////////////////////////////////////////////////////////////////////////////
+// CpuState
+//
+
+void CpuState::log_jump(ulong_t addr)
+{
+  if (!_seen_jumps.contains(addr)) {
+    P("New jump addr: 0x{05x}", addr);
+    _seen_jumps.insert(addr);
+  }
+}
+
+namespace {
+
+using Handler = MicroOp::Handler;
+
+////////////////////////////////////////////////////////////////////////////////
+// Operand access
+//
+
+template <class T> inline T read_reg(int reg)
+{
+  return reg < 8 ? G.d[reg].get<T>() : G.a[reg - 8].get<T>();
+}
+
+template <class T> inline void write_reg(int reg, T value)
+{
+  if (reg < 8) {
+    G.d[reg].set<T>(value);
+  } else {
+    G.a[reg - 8].set<T>(value);
+  }
+}
+
+inline slong_t read_reg_s(SizeKind size, int reg)
+{
+  return reg < 8 ? G.d[reg].get_s(size) : G.a[reg - 8].get_s(size);
+}
+
+// Same as Machine::read_address, post increment and pre decrement are applied
+// when the location is computed. The location is the immediate value for Imm,
+// the register number for Reg and the effective address for everything else.
+template <class T, OperandKind K> inline ulong_t locate(const Operand& o)
+{
+  if constexpr (K == OperandKind::Imm) {
+    return ulong_t(o.imm);
+  } else if constexpr (K == OperandKind::Reg) {
+    return o.reg;
+  } else if constexpr (K == OperandKind::Ind) {
+    return read_reg<L>(o.reg);
+  } else if constexpr (K == OperandKind::PostInc) {
+    ulong_t addr = read_reg<L>(o.reg);
+    write_reg<L>(o.reg, addr + sizeof(T));
+    return addr;
+  } else if constexpr (K == OperandKind::PreDec) {
+    ulong_t addr = read_reg<L>(o.reg) - sizeof(T);
+    write_reg<L>(o.reg, addr);
+    return addr;
+  } else if constexpr (K == OperandKind::Disp) {
+    return read_reg_s(o.idx_size, o.reg) + o.imm;
+  } else if constexpr (K == OperandKind::Index) {
+    return read_reg<L>(o.reg) + read_reg_s(o.idx_size, o.idx_reg) + o.imm;
+  } else {
+    static_assert(K == OperandKind::Abs);
+    return ulong_t(o.imm);
+  }
+}
+
+template <class T, OperandKind K> inline T read(ulong_t loc)
+{
+  if constexpr (K == OperandKind::Imm) {
+    return T(loc);
+  } else if constexpr (K == OperandKind::Reg) {
+    return read_reg<T>(loc);
+  } else {
+    return G.io->read<T>(loc);
+  }
+}
+
+template <class T, OperandKind K> inline void write(ulong_t loc, T value)
+{
+  if constexpr (K == OperandKind::Imm) {
+    raise_error("Not supported");
+  } else if constexpr (K == OperandKind::Reg) {
+    write_reg<T>(loc, value);
+  } else {
+    G.io->write<T>(loc, value);
+  }
+}
+
+template <class T> inline void push(T value)
+{
+  ulong_t sp = G.a[7].l() - sizeof(T);
+  G.a[7].l(sp);
+  G.io->write<T>(sp, value);
+}
+
+template <class T> inline T pop()
+{
+  ulong_t sp = G.a[7].l();
+  T ret = G.io->read<T>(sp);
+  G.a[7].l(sp + sizeof(T));
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Operations
+//
+
+#define DEFINE_OP2(name, impl)                                                 \
+  struct name {                                                                \
+    template <class T> static inline auto apply(T dst, T src)                  \
+    {                                                                          \
+      return impl(dst, src);                                                   \
+    }                                                                          \
+  }
+
+#define DEFINE_OP1(name, impl)                                                 \
+  struct name {                                                                \
+    template <class T> static inline T apply(T dst) { return impl(dst); }      \
+  }
+
+DEFINE_OP2(Add, ADD<T>);
+DEFINE_OP2(Sub, SUB<T>);
+DEFINE_OP2(AddNF, ADD_NF<T>);
+DEFINE_OP2(SubNF, SUB_NF<T>);
+DEFINE_OP2(And, AND<T>);
+DEFINE_OP2(Or, OR<T>);
+DEFINE_OP2(Eor, EOR<T>);
+DEFINE_OP2(Bset, BSET<T>);
+DEFINE_OP2(Bclr, BCLR<T>);
+DEFINE_OP2(Bchg, BCHG<T>);
+DEFINE_OP2(Ror, ROR<T>);
+DEFINE_OP2(Rol, ROL<T>);
+DEFINE_OP2(Lsr, LSR<T>);
+DEFINE_OP2(Lsl, LSL<T>);
+DEFINE_OP2(Asr, ASR<T>);
+DEFINE_OP2(Asl, ASL<T>);
+DEFINE_OP2(Abcd, ABCD);
+DEFINE_OP2(Muls, MULS);
+DEFINE_OP2(Mulu, MULU);
+DEFINE_OP2(Divs, DIVS);
+DEFINE_OP2(Divu, DIVU);
+DEFINE_OP2(Cmp, CMP<T>);
+DEFINE_OP2(Btst, (BTST<T>));
+
+DEFINE_OP1(Neg, NEG<T>);
+DEFINE_OP1(Not, NOT<T>);
+DEFINE_OP1(Ext, EXT<T>);
+DEFINE_OP1(Swap, SWAP);
+
+#undef DEFINE_OP2
+#undef DEFINE_OP1
+
+////////////////////////////////////////////////////////////////////////////////
+// Handlers
+//
+
+// Handlers are instantiated for the kinds of the operands they use, SK for the
+// source and DK for the destination, so locating, reading and writing an
+// operand compiles down to the code of that one addressing mode
+
+using K = OperandKind;
+
+// The operation is done with the size of the destination, which is always long
+// for address registers
+template <class Op, class S, class T, K SK, K DK>
+void alu(const MicroOp& op, CpuState&)
+{
+  auto dst = locate<T, DK>(op.dst);
+  auto src = locate<S, SK>(op.src);
+  T d = read<T, DK>(dst);
+  S s = read<S, SK>(src);
+  write<T, DK>(dst, Op::template apply<T>(d, s));
+}
+
+template <class Op, K SK, K DK> void mul(const MicroOp& op, CpuState&)
+{
+  auto dst = locate<W, DK>(op.dst);
+  auto src = locate<W, SK>(op.src);
+  W d = read<W, DK>(dst);
+  W s = read<W, SK>(src);
+  write<L, DK>(dst, Op::template apply<L>(d, s));
+}
+
+template <class Op, class T, K SK, K DK>
+void cmp(const MicroOp& op, CpuState&)
+{
+  auto src = locate<T, SK>(op.src);
+  auto dst = locate<T, DK>(op.dst);
+  T d = read<T, DK>(dst);
+  T s = read<T, SK>(src);
+  Op::template apply<T>(d, s);
+}
+
+template <class Op, class T, K DK> void unary(const MicroOp& op, CpuState&)
+{
+  auto dst = locate<T, DK>(op.dst);
+  write<T, DK>(dst, Op::template apply<T>(read<T, DK>(dst)));
+}
+
+template <class T, bool UpdateCC, K SK, K DK>
+void move(const MicroOp& op, CpuState&)
+{
+  T value = read<T, SK>(locate<T, SK>(op.src));
+  write<T, DK>(locate<T, DK>(op.dst), value);
+  if constexpr (UpdateCC) { TST<T>(value); }
+}
+
+template <class T, K SK> void tst(const MicroOp& op, CpuState&)
+{
+  TST<T>(read<T, SK>(locate<T, SK>(op.src)));
+}
+
+template <class T, K DK> void clr(const MicroOp& op, CpuState&)
+{
+  write<T, DK>(locate<T, DK>(op.dst), 0);
+}
+
+template <class T, K SK, K DK> void lea(const MicroOp& op, CpuState&)
+{
+  auto src = locate<T, SK>(op.src);
+  write<T, DK>(locate<T, DK>(op.dst), src);
+}
+
+template <class T, K SK, K DK> void exg(const MicroOp& op, CpuState&)
+{
+  auto dst = locate<T, DK>(op.dst);
+  auto src = locate<T, SK>(op.src);
+  T d = read<T, DK>(dst);
+  T s = read<T, SK>(src);
+  write<T, DK>(dst, s);
+  write<T, SK>(src, d);
+}
+
+template <class T, K DK> void dbcc(const MicroOp& op, CpuState& cpu)
+{
+  if (G.sr.check_condition(op.cond)) { return; }
+  auto dst = locate<T, DK>(op.dst);
+  slong_t value = slong_t(read<T, DK>(dst)) - 1;
+  write<T, DK>(dst, value);
+  if (value != -1) { cpu.pc = op.target; }
+}
+
+void bcc(const MicroOp& op, CpuState& cpu)
+{
+  if (G.sr.check_condition(op.cond)) { cpu.pc = op.target; }
+}
+
+template <K SK> void jmp(const MicroOp& op, CpuState& cpu)
+{
+  cpu.pc = locate<L, SK>(op.src);
+  cpu.log_jump(cpu.pc);
+}
+
+template <bool LogJump, K SK> void jsr(const MicroOp& op, CpuState& cpu)
+{
+  push<L>(cpu.pc);
+  cpu.pc = locate<L, SK>(op.src);
+  if constexpr (LogJump) { cpu.log_jump(cpu.pc); }
+}
+
+void rts(const MicroOp&, CpuState& cpu) { cpu.pc = pop<L>(); }
+
+void rte(const MicroOp&, CpuState& cpu)
+{
+  G.sr.set_from_int(pop<W>());
+  cpu.pc = pop<L>();
+  cpu.is_interrupting = false;
+  G.vblank();
+}
+
+void nop(const MicroOp&, CpuState&) {}
+
+////////////////////////////////////////////////////////////////////////////////
+// Lowering
+//
+
+template <class F> Handler by_size(SizeKind size, F&& f)
+{
+  switch (size) {
+  case SizeKind::Byte:
+    return f.template operator()<B>();
+  case SizeKind::Word:
+    return f.template operator()<W>();
+  case SizeKind::Long:
+    return f.template operator()<L>();
+  }
+}
+
+template <class F> Handler by_kind(K kind, F&& f)
+{
+  switch (kind) {
+  case K::Imm:
+    return f.template operator()<K::Imm>();
+  case K::Reg:
+    return f.template operator()<K::Reg>();
+  case K::Ind:
+    return f.template operator()<K::Ind>();
+  case K::PostInc:
+    return f.template operator()<K::PostInc>();
+  case K::PreDec:
+    return f.template operator()<K::PreDec>();
+  case K::Disp:
+    return f.template operator()<K::Disp>();
+  case K::Index:
+    return f.template operator()<K::Index>();
+  case K::Abs:
+    return f.template operator()<K::Abs>();
+  }
+}
+
+// Instantiates f for the kind of the destination. Immediate destinations are
+// not lowered, so they are left to the interpreter.
+template <class F> Handler by_dst_kind(const MicroOp& op, F&& f)
+{
+  return by_kind(op.dst.kind, [&]<K DK>() -> Handler {
+    if constexpr (DK == K::Imm) {
+      return nullptr;
+    } else {
+      return f.template operator()<DK>();
+    }
+  });
+}
+
+template <class F> Handler by_kinds(const MicroOp& op, F&& f)
+{
+  return by_kind(op.src.kind, [&]<K SK>() {
+    return by_dst_kind(
+      op, [&]<K DK>() { return f.template operator()<SK, DK>(); });
+  });
+}
+
+// Address register destinations are always Reg, which saves instantiating the
+// long variants for every other kind
+template <class Op>
+Handler alu_handler(const MicroOp& op, SizeKind size, bool dst_is_addr_reg)
+{
+  return by_size(size, [&]<class S>() {
+    if (dst_is_addr_reg) {
+      return by_kind(op.src.kind, [&]<K SK>() -> Handler {
+        return alu<Op, S, L, SK, K::Reg>;
+      });
+    }
+    return by_kinds(
+      op, [&]<K SK, K DK>() -> Handler { return alu<Op, S, S, SK, DK>; });
+  });
+}
+
+template <class Op> Handler cmp_handler(const MicroOp& op, SizeKind size)
+{
+  return by_size(size, [&]<class T>() {
+    return by_kinds(
+      op, [&]<K SK, K DK>() -> Handler { return cmp<Op, T, SK, DK>; });
+  });
+}
+
+template <class Op> Handler unary_handler(const MicroOp& op, SizeKind size)
+{
+  return by_size(size, [&]<class T>() {
+    return by_dst_kind(
+      op, [&]<K DK>() -> Handler { return unary<Op, T, DK>; });
+  });
+}
+
+template <bool UpdateCC>
+Handler move_handler(const MicroOp& op, SizeKind size)
+{
+  return by_size(size, [&]<class T>() {
+    return by_kinds(
+      op, [&]<K SK, K DK>() -> Handler { return move<T, UpdateCC, SK, DK>; });
+  });
+}
+
+std::optional<int> reg_num(const RegisterId& id)
+{
+  switch (id.kind) {
+  case RegisterKind::Data:
+    return id.reg_id;
+  case RegisterKind::Addr:
+    return id.reg_id + 8;
+  case RegisterKind::SR:
+    return std::nullopt;
+  }
+}
+
+std::optional<Operand> lower_operand(const AddrMode& am)
+{
+  auto reg = reg_num(am.reg);
+  auto reg2 = reg_num(am.reg2);
+  if (!reg.has_value() || !reg2.has_value()) { return std::nullopt; }
+
+  auto make = [&](OperandKind kind, slong_t imm) {
+    return Operand{
+      .kind = kind,
+      .reg = ubyte_t(*reg),
+      .idx_reg = ubyte_t(*reg2),
+      .idx_size = am.idx_size,
+      .imm = imm,
+    };
+  };
+
+  switch (am.kind) {
+  case AddrModeKind::ImmByte:
+    return make(OperandKind::Imm, sbyte_t(am.imm));
+  case AddrModeKind::ImmWord:
+    return make(OperandKind::Imm, sword_t(am.imm));
+  case AddrModeKind::ImmLong:
+    return make(OperandKind::Imm, slong_t(am.imm));
+  case AddrModeKind::ImmAddrWord:
+    return make(OperandKind::Abs, uword_t(am.imm));
+  case AddrModeKind::ImmAddrLong:
+    return make(OperandKind::Abs, ulong_t(am.imm));
+  case AddrModeKind::Reg:
+    return make(OperandKind::Reg, 0);
+  case AddrModeKind::AReg:
+    return make(OperandKind::Ind, 0);
+  case AddrModeKind::PostInc:
+    return make(OperandKind::PostInc, 0);
+  case AddrModeKind::PreDec:
+    return make(OperandKind::PreDec, 0);
+  case AddrModeKind::ALongDisp:
+    return make(OperandKind::Disp, slong_t(am.imm));
+  case AddrModeKind::AXByteDisp:
+    return make(OperandKind::Index, sbyte_t(am.imm));
+  }
+}
+
+Handler select_handler(const Instruction& inst, MicroOp& op)
+{
+  auto size = inst.size.value_or(SizeKind::l());
+  bool dst_is_addr_reg = inst.dst.has_value() && inst.dst->is_addr_reg();
+
+  switch (inst.name) {
+  case InstEnum::TST:
+    return by_size(size, [&]<class T>() {
+      return by_kind(op.src.kind, []<K SK>() -> Handler { return tst<T, SK>; });
+    });
+  case InstEnum::CLR:
+    return by_size(size, [&]<class T>() {
+      return by_dst_kind(op, []<K DK>() -> Handler { return clr<T, DK>; });
+    });
+  case InstEnum::LEA:
+    return by_size(size, [&]<class T>() {
+      return by_kinds(
+        op, []<K SK, K DK>() -> Handler { return lea<T, SK, DK>; });
+    });
+  case InstEnum::EXG:
+    return by_size(size, [&]<class T>() {
+      return by_kinds(
+        op, []<K SK, K DK>() -> Handler { return exg<T, SK, DK>; });
+    });
+  case InstEnum::MOVE:
+  case InstEnum::MOVEQ:
+    if (inst.is_addr_reg_update()) { return move_handler<false>(op, size); }
+    return move_handler<true>(op, size);
+  case InstEnum::MOVE_USP:
+    return move_handler<false>(op, size);
+  case InstEnum::Bcc:
+  case InstEnum::DBcc: {
+    if (op.src.kind != OperandKind::Abs) { return nullptr; }
+    op.cond = inst.cond.value();
+    op.target = op.src.imm;
+    if (inst.name == InstEnum::Bcc) { return bcc; }
+    return by_size(size, [&]<class T>() {
+      return by_dst_kind(op, []<K DK>() -> Handler { return dbcc<T, DK>; });
+    });
+  }
+  case InstEnum::ADD:
+  case InstEnum::ADDA:
+  case InstEnum::ADDI:
+  case InstEnum::ADDQ:
+    if (inst.is_addr_reg_update()) {
+      return alu_handler<AddNF>(op, size, dst_is_addr_reg);
+    }
+    return alu_handler<Add>(op, size, dst_is_addr_reg);
+  case InstEnum::SUB:
+  case InstEnum::SUBA:
+  case InstEnum::SUBI:
+  case InstEnum::SUBQ:
+    if (inst.is_addr_reg_update()) {
+      return alu_handler<SubNF>(op, size, dst_is_addr_reg);
+    }
+    return alu_handler<Sub>(op, size, dst_is_addr_reg);
+  case InstEnum::AND:
+  case InstEnum::ANDI:
+    return alu_handler<And>(op, size, dst_is_addr_reg);
+  case InstEnum::OR:
+  case InstEnum::ORI:
+    return alu_handler<Or>(op, size, dst_is_addr_reg);
+  case InstEnum::EOR:
+  case InstEnum::EORI:
+    return alu_handler<Eor>(op, size, dst_is_addr_reg);
+  case InstEnum::BSET:
+    return alu_handler<Bset>(op, size, dst_is_addr_reg);
+  case InstEnum::BCLR:
+    return alu_handler<Bclr>(op, size, dst_is_addr_reg);
+  case InstEnum::BCHG:
+    return alu_handler<Bchg>(op, size, dst_is_addr_reg);
+  case InstEnum::ROR:
+    return alu_handler<Ror>(op, size, dst_is_addr_reg);
+  case InstEnum::ROL:
+    return alu_handler<Rol>(op, size, dst_is_addr_reg);
+  case InstEnum::LSR:
+    return alu_handler<Lsr>(op, size, dst_is_addr_reg);
+  case InstEnum::LSL:
+    return alu_handler<Lsl>(op, size, dst_is_addr_reg);
+  case InstEnum::ASR:
+    return alu_handler<Asr>(op, size, dst_is_addr_reg);
+  case InstEnum::ASL:
+    return alu_handler<Asl>(op, size, dst_is_addr_reg);
+  case InstEnum::ABCD:
+    return alu_handler<Abcd>(op, size, dst_is_addr_reg);
+  case InstEnum::MULS:
+    return by_kinds(
+      op, []<K SK, K DK>() -> Handler { return mul<Muls, SK, DK>; });
+  case InstEnum::MULU:
+    return by_kinds(
+      op, []<K SK, K DK>() -> Handler { return mul<Mulu, SK, DK>; });
+  case InstEnum::DIVS:
+    return by_kinds(
+      op, []<K SK, K DK>() -> Handler { return alu<Divs, W, L, SK, DK>; });
+  case InstEnum::DIVU:
+    return by_kinds(
+      op, []<K SK, K DK>() -> Handler { return alu<Divu, W, L, SK, DK>; });
+  case InstEnum::BTST:
+    return cmp_handler<Btst>(op, size);
+  case InstEnum::CMP:
+  case InstEnum::CMPA:
+  case InstEnum::CMPI:
+    return cmp_handler<Cmp>(op, size);
+  case InstEnum::NEG:
+    return unary_handler<Neg>(op, size);
+  case InstEnum::NOT:
+    return unary_handler<Not>(op, size);
+  case InstEnum::EXT:
+    return unary_handler<Ext>(op, size);
+  case InstEnum::SWAP:
+    return unary_handler<Swap>(op, size);
+  case InstEnum::JMP:
+    return by_kind(op.src.kind, []<K SK>() -> Handler { return jmp<SK>; });
+  case InstEnum::JSR:
+    return by_kind(
+      op.src.kind, []<K SK>() -> Handler { return jsr<true, SK>; });
+  case InstEnum::BSR:
+    return by_kind(
+      op.src.kind, []<K SK>() -> Handler { return jsr<false, SK>; });
+  case InstEnum::RTS:
+    return rts;
+  case InstEnum::RTE:
+    return rte;
+  case InstEnum::NOP:
+    return nop;
+  default:
+    // MOVEM and anything touching SR are left to the interpreter
+    return nullptr;
+  }
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+// MicroOp
+//
+
+MicroOp MicroOp::lower(const Instruction& inst)
+{
+  MicroOp op{
+    .handler = nullptr,
+    .next_pc = inst.pc + inst.bytes,
+    .src = {},
+    .dst = {},
+    .cond = {},
+    .target = 0,
+  };
+
+  if (inst.src.has_value()) {
+    auto src = lower_operand(*inst.src);
+    if (!src.has_value()) { return op; }
+    op.src = *src;
+  }
+  if (inst.dst.has_value()) {
+    auto dst = lower_operand(*inst.dst);
+    if (!dst.has_value()) { return op; }
+    op.dst = *dst;
+  }
+
+  op.handler = select_handler(inst, op);
+  return op;
+}
+
+} // namespace heaven_ice
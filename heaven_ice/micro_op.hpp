@@ -0,0 +1,85 @@
+#pragma once
+
+#include <unordered_set>
+
+#include "condition.hpp"
+#include "instruction.hpp"
+#include "size_kind.hpp"
+#include "types.hpp"
+
+namespace heaven_ice {
+
+////////////////////////////////////////////////////////////////////////////////
+// CpuState
+//
+
+struct CpuState {
+ public:
+  ulong_t pc = 0x200;
+  bool is_interrupting = false;
+
+  void log_jump(ulong_t addr);
+
+ private:
+  std::unordered_set<ulong_t> _seen_jumps;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// OperandKind
+//
+
+// AddrModeKind with everything that can be resolved when the instruction is
+// lowered already resolved: immediates are sign extended and absolute
+// addresses are normalized.
+enum class OperandKind : ubyte_t {
+  Imm,
+  Reg,
+  Ind,
+  PostInc,
+  PreDec,
+  Disp,
+  Index,
+  Abs,
+};
+
+struct Operand {
+  OperandKind kind;
+
+  // Registers are numbered 0-15, 0-7 being the data registers and 8-15 the
+  // addr registers
+  ubyte_t reg;
+  ubyte_t idx_reg;
+
+  SizeKind idx_size;
+
+  // Immediate value, displacement or absolute address
+  slong_t imm;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// MicroOp
+//
+
+struct MicroOp {
+ public:
+  using Handler = void (*)(const MicroOp& op, CpuState& cpu);
+
+  // Instantiated for the operation, the size and the kinds of both operands.
+  // nullptr when the instruction could not be lowered, the caller is expected
+  // to execute the original instruction instead
+  Handler handler;
+
+  ulong_t next_pc;
+
+  Operand src;
+  Operand dst;
+
+  Condition cond;
+
+  // Branch target for Bcc and DBcc
+  ulong_t target;
+
+  static MicroOp lower(const Instruction& inst);
+};
+
+} // namespace heaven_ice
@@ -5,9 +5,36 @@
 namespace heaven_ice {
 
 OpcodeDecoder::OpcodeDecoder(const std::vector<InstructionSpec>& insts)
-    : _insts(insts)
+    : _insts(insts),
+      _spec_idx(build_spec_idx(_insts)),
+      _decoded(build_decoded(_insts, _spec_idx))
 {}
 
+std::vector<sword_t> OpcodeDecoder::build_spec_idx(
+  const std::vector<InstructionSpec>& insts)
+{
+  std::vector<sword_t> spec_idx(NumOpcodes, -1);
+  for (int opcode = 0; opcode < NumOpcodes; opcode++) {
+    auto idx = find_spec_linear(insts, opcode);
+    if (idx.has_value()) { spec_idx[opcode] = *idx; }
+  }
+  return spec_idx;
+}
+
+std::vector<std::optional<InstFields>> OpcodeDecoder::build_decoded(
+  const std::vector<InstructionSpec>& insts,
+  const std::vector<sword_t>& spec_idx)
+{
+  std::vector<std::optional<InstFields>> decoded(NumOpcodes);
+  for (int opcode = 0; opcode < NumOpcodes; opcode++) {
+    auto idx = spec_idx[opcode];
+    if (idx < 0) { continue; }
+    auto fields = insts[idx].parse_fields(opcode);
+    if (!fields.is_error()) { decoded[opcode].emplace(fields.value()); }
+  }
+  return decoded;
+}
+
 bee::OrError<OpcodeDecoder::ptr> OpcodeDecoder::create_from_file(
   const bee::FilePath& filepath)
 {
@@ -17,13 +44,30 @@ bee::OrError<OpcodeDecoder::ptr> OpcodeDecoder::create_from_file(
 
 bee::OrError<InstFields> OpcodeDecoder::decode(uword_t opcode) const
 {
-  for (auto&& inst : _insts) {
-    if ((opcode & inst.opcode_mask) == inst.masked_opcode) {
-      bail(fields, inst.parse_fields(opcode), inst.name);
-      return fields;
-    }
+  if (const auto& fields = _decoded[opcode]; fields.has_value()) {
+    return *fields;
+  }
+  auto idx = _spec_idx[opcode];
+  if (idx < 0) { return EF("Invalid opcode: $", opcode); }
+  const auto& inst = _insts[idx];
+  bail(fields, inst.parse_fields(opcode), inst.name);
+  return fields;
+}
+
+std::optional<int> OpcodeDecoder::spec_index(uword_t opcode) const
+{
+  auto idx = _spec_idx[opcode];
+  if (idx < 0) { return std::nullopt; }
+  return idx;
+}
+
+std::optional<int> OpcodeDecoder::find_spec_linear(
+  const std::vector<InstructionSpec>& insts, uword_t opcode)
+{
+  for (int i = 0; i < std::ssize(insts); i++) {
+    if (insts[i].match(opcode)) { return i; }
   }
-  return EF("Invalid opcode: $", opcode);
+  return std::nullopt;
 }
 
 } // namespace heaven_ice
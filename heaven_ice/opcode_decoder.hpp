@@ -1,5 +1,6 @@
 #pragma once
 
+#include <optional>
 #include <vector>
 
 #include "instruction_spec.hpp"
@@ -17,8 +18,31 @@ struct OpcodeDecoder {
 
   bee::OrError<InstFields> decode(uword_t opcode) const;
 
+  // Index of the spec used to decode the opcode, as stored in the dispatch
+  // table
+  std::optional<int> spec_index(uword_t opcode) const;
+
+  // Reference implementation of the dispatch, walks every spec in order
+  static std::optional<int> find_spec_linear(
+    const std::vector<InstructionSpec>& insts, uword_t opcode);
+
  private:
-  std::vector<InstructionSpec> _insts;
+  static constexpr int NumOpcodes = 1 << 16;
+
+  static std::vector<sword_t> build_spec_idx(
+    const std::vector<InstructionSpec>& insts);
+
+  static std::vector<std::optional<InstFields>> build_decoded(
+    const std::vector<InstructionSpec>& insts,
+    const std::vector<sword_t>& spec_idx);
+
+  const std::vector<InstructionSpec> _insts;
+
+  // Both tables are indexed by the opcode and built up front, so decoding is a
+  // single load. _decoded is empty for opcodes that don't match any spec or
+  // that fail to parse, in which case the error is produced from _spec_idx.
+  const std::vector<sword_t> _spec_idx;
+  const std::vector<std::optional<InstFields>> _decoded;
 };
 
 } // namespace heaven_ice
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <array>
+
+#include "types.hpp"
+
+namespace heaven_ice {
+
+constexpr int PALETTE_SIZE = 0x40;
+
+struct Color {
+  ubyte_t r;
+  ubyte_t g;
+  ubyte_t b;
+};
+
+// The CRAM converted to host colors, indexed the same way, palette * 16 +
+// color
+using Palette = std::array<Color, PALETTE_SIZE>;
+
+} // namespace heaven_ice
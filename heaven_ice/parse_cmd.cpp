@@ -0,0 +1,115 @@
+#include "parse_cmd.hpp"
+
+#include <map>
+#include <vector>
+
+#include "instruction_spec.hpp"
+#include "opcode_decoder.hpp"
+#include "parse_spec.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/format_vector.hpp"
+#include "bee/or_error.hpp"
+#include "bee/print.hpp"
+#include "command/command_builder.hpp"
+#include "command/file_path.hpp"
+
+namespace heaven_ice {
+namespace {
+
+bee::OrError<> parse_main(const bee::FilePath& filepath)
+{
+  bail(insts, ParseSpec::parse_spec(filepath));
+  P("Num instructions: $", insts.size());
+  for (auto&& inst : insts) {
+    int size = inst.size();
+    if (size != 16) {
+      return EF("Instruction has the wrong size, got $, spec:'$'", size, inst);
+    }
+  }
+  int num_matched = 0;
+  int num_unmatched = 0;
+  std::map<int, int> matches_by_idx;
+  std::map<std::pair<int, int>, int> overlaps;
+
+  // Checks the dispatch table against every spec that matches each opcode.
+  // The spec file is in priority order, so the table has to hold the first
+  // matching spec and decode has to succeed exactly when that spec parses.
+  OpcodeDecoder decoder(insts);
+  for (int i = 0; i < 1 << 16; i++) {
+    std::vector<int> matching;
+    for (int j = 0; j < std::ssize(insts); j++) {
+      if (insts[j].match(i)) { matching.push_back(j); }
+    }
+    auto table_idx = decoder.spec_index(i);
+    if (matching.empty()) {
+      if (table_idx.has_value()) {
+        return EF(
+          "Opcode {04x} has spec $ in the dispatch table but matches none",
+          i,
+          *table_idx);
+      }
+      num_unmatched++;
+      continue;
+    }
+    int idx = matching.front();
+    if (table_idx != idx) {
+      return EF(
+        "Dispatch table has spec $ for opcode {04x}, expected $",
+        table_idx.value_or(-1),
+        i,
+        idx);
+    }
+    auto fields = insts[idx].parse_fields(i);
+    auto decoded = decoder.decode(i);
+    if (fields.is_error() != decoded.is_error()) {
+      return EF(
+        "Decoding opcode {04x} disagrees with spec $: parse:$ decode:$",
+        i,
+        idx,
+        !fields.is_error(),
+        !decoded.is_error());
+    }
+    InstEnum::E name = insts[idx].name;
+    if (!decoded.is_error() && decoded->name != name) {
+      return EF(
+        "Opcode {04x} decoded as $, expected $", i, decoded->name, name);
+    }
+    num_matched++;
+    matches_by_idx[idx]++;
+    for (int j = 1; j < std::ssize(matching); j++) {
+      overlaps[{idx, matching[j]}]++;
+    }
+  }
+  P("matched:$\nunmachted:$", num_matched, num_unmatched);
+  P("Dispatch table is consistent with the specs");
+
+  // These are only decoded correctly because of the order of the spec file
+  for (const auto& [pair, count] : overlaps) {
+    P("Spec $ shadows spec $ on $ opcodes",
+      insts[pair.first],
+      insts[pair.second],
+      count);
+  }
+
+  for (int i = 0; i < std::ssize(insts); i++) {
+    int count = matches_by_idx[i];
+    if (count == 0) {
+      raise_error("No matches for spec: line:$ inst:$", i + 1, insts);
+    }
+  }
+
+  return bee::ok();
+}
+
+} // namespace
+
+command::Cmd ParseCmd::cmd()
+{
+  using namespace command::flags;
+  auto builder = command::CommandBuilder("Parse");
+  auto filepath = builder.required_anon(FilePath, "FILEPATH", "Rom file");
+  return builder.run([=]() { return parse_main(*filepath); });
+}
+
+} // namespace heaven_ice
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "command/cmd.hpp"
+
+namespace heaven_ice {
+
+struct ParseCmd {
+  static command::Cmd cmd();
+};
+
+} // namespace heaven_ice
@@ -1,7 +1,5 @@
 #include "parse_spec.hpp"
 
-#include <map>
-
 #include "instruction_field.hpp"
 #include "instruction_spec.hpp"
 #include "types.hpp"
@@ -10,65 +8,9 @@
 #include "bee/file_reader.hpp"
 #include "bee/format_vector.hpp"
 #include "bee/or_error.hpp"
-#include "bee/print.hpp"
 #include "bee/string_util.hpp"
-#include "command/command_builder.hpp"
-#include "command/file_path.hpp"
 
 namespace heaven_ice {
-namespace {
-
-bee::OrError<> parse_main(const bee::FilePath& filepath)
-{
-  bail(insts, ParseSpec::parse_spec(filepath));
-  P("Num instructions: $", insts.size());
-  for (auto&& inst : insts) {
-    int size = inst.size();
-    if (size != 16) {
-      return EF("Instruction has the wrong size, got $, spec:'$'", size, inst);
-    }
-  }
-  int num_matched = 0;
-  int num_unmatched = 0;
-  std::map<int, int> matches_by_idx;
-
-  for (int i = 0; i < 1 << 16; i++) {
-    bool matched = false;
-    for (int j = 0; j < std ::ssize(insts); j++) {
-      auto&& inst = insts[j];
-      if (inst.match(i)) {
-        matched = true;
-        matches_by_idx[j]++;
-        break;
-      }
-    }
-    if (matched) {
-      num_matched++;
-    } else {
-      num_unmatched++;
-    }
-  }
-  P("matched:$\nunmachted:$", num_matched, num_unmatched);
-
-  for (int i = 0; i < std::ssize(insts); i++) {
-    int count = matches_by_idx[i];
-    if (count == 0) {
-      raise_error("No matches for spec: line:$ inst:$", i + 1, insts);
-    }
-  }
-
-  return bee::ok();
-}
-
-} // namespace
-
-command::Cmd ParseSpec::cmd()
-{
-  using namespace command::flags;
-  auto builder = command::CommandBuilder("Parse");
-  auto filepath = builder.required_anon(FilePath, "FILEPATH", "Rom file");
-  return builder.run([=]() { return parse_main(*filepath); });
-}
 
 bee::OrError<std::vector<InstructionSpec>> ParseSpec::parse_spec(
   const bee::FilePath& filepath)
@@ -0,0 +1,40 @@
+#include "rom.hpp"
+#include "to_cpp.hpp"
+
+#include "bee/or_error.hpp"
+#include "command/command_builder.hpp"
+#include "command/file_path.hpp"
+#include "command/group_builder.hpp"
+
+namespace heaven_ice {
+namespace {
+
+command::Cmd to_cpp_cmd()
+{
+  using namespace command::flags;
+  auto builder = command::CommandBuilder("Convert to cpp");
+  auto filepath = builder.required_anon(FilePath, "FILEPATH", "Rom file");
+  auto inline_budget =
+    builder.optional_with_default("--inline-budget", Int, 16);
+  auto output_dir = builder.optional("--output-dir", FilePath);
+  auto shards = builder.optional_with_default("--shards", Int, 8);
+  return builder.run([=]() -> bee::OrError<> {
+    bail(rom, Rom::open(*filepath));
+    return ToCpp::to_cpp(rom, *inline_budget, *output_dir, *shards);
+  });
+}
+
+// The recompiler is its own binary so it doesn't link the generated code it
+// replaces
+int main(int argc, char* argv[])
+{
+  return command::GroupBuilder("Recompiler")
+    .cmd("to-cpp", to_cpp_cmd())
+    .build()
+    .main(argc, argv);
+}
+
+} // namespace
+} // namespace heaven_ice
+
+int main(int argc, char* argv[]) { return heaven_ice::main(argc, argv); }
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "size_kind.hpp"
 #include "types.hpp"
 
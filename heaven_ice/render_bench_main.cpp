@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "magic_constants.hpp"
+#include "tile_row.hpp"
+#include "vdp.hpp"
+
+#include "bee/print.hpp"
+#include "bee/simple_checksum.hpp"
+#include "bee/time.hpp"
+
+namespace heaven_ice {
+namespace {
+
+constexpr int Frames = 256;
+constexpr int RowRounds = 1 << 22;
+constexpr int LineSize = 320;
+
+constexpr TileRow::Kernel Kernels[] = {
+  TileRow::Kernel::Scalar,
+  TileRow::Kernel::SSSE3,
+};
+
+// The [begin, end[ ranges rows are checked with
+constexpr std::pair<int, int> Clips[] = {{0, 8}, {3, 8}, {0, 5}, {2, 6}};
+
+void set_reg(VDP& vdp, int reg, ubyte_t value)
+{
+  vdp.write<uword_t>(VDP_CTRL1, 0x8000 | (reg << 8) | value);
+}
+
+void fill_random(VDP& vdp, ulong_t cmd, int words, std::mt19937& gen)
+{
+  vdp.write<ulong_t>(VDP_CTRL1, cmd);
+  for (int i = 0; i < words; i++) {
+    vdp.write<uword_t>(VDP_DATA1, uword_t(gen()));
+  }
+}
+
+// A VDP with random VRAM, CRAM and VSRAM, so the planes and sprites are full
+// of random tiles, with the tables at the usual places
+VDP::ptr make_vdp()
+{
+  auto vdp = VDP::create(false);
+  std::mt19937 gen(42);
+  set_reg(*vdp, 0x02, 0x30); // foreground at c000
+  set_reg(*vdp, 0x03, 0x2c); // window at b000
+  set_reg(*vdp, 0x04, 0x07); // background at e000
+  set_reg(*vdp, 0x05, 0x6c); // sprites at d800
+  set_reg(*vdp, 0x0d, 0x2e); // hscroll at b800
+  set_reg(*vdp, 0x0f, 0x02);
+  set_reg(*vdp, 0x10, 0x11); // 64x64 planes
+  set_reg(*vdp, 0x12, 0x04); // window on the top 32 lines
+  fill_random(*vdp, 0x40000000, 0x8000, gen);
+  fill_random(*vdp, 0xc0000000, 0x40, gen);
+  fill_random(*vdp, 0x40000010, 0x28, gen);
+  return vdp;
+}
+
+// What the renderer used to do, every pixel is decoded from the VRAM bits and
+// drawn on its own
+void draw_row_per_pixel(
+  ulong_t bits,
+  bool xflip,
+  ubyte_t attr,
+  ubyte_t keep,
+  ubyte_t* dst,
+  int begin,
+  int end)
+{
+  for (int x = begin; x < end; x++) {
+    int bx = xflip ? TileRow::Size - 1 - x : x;
+    ubyte_t color = (bits >> ((TileRow::Size - 1 - bx) * 4)) & 0xf;
+    ubyte_t& pixel = dst[x - begin];
+    if (color == 0 || (pixel & keep) != 0) { continue; }
+    pixel = color | attr;
+  }
+}
+
+// Rows with a mix of transparent and opaque pixels, drawn over a line that
+// already has some high priority pixels
+struct RowInputs {
+  std::vector<ulong_t> bits;
+  std::vector<ubyte_t> line;
+
+  static RowInputs make()
+  {
+    std::mt19937 gen(42);
+    RowInputs inputs;
+    inputs.bits.resize(256);
+    for (auto& b : inputs.bits) { b = gen() & gen(); }
+    inputs.line.resize(LineSize);
+    for (auto& p : inputs.line) { p = gen() & 0x8f; }
+    return inputs;
+  }
+};
+
+// Draws the rows of inputs over its line with the per pixel code or with the
+// current kernels, clipped to [begin, end[
+void draw_rows(
+  const RowInputs& inputs,
+  std::vector<ubyte_t>& line,
+  int rounds,
+  bool per_pixel,
+  int begin = 0,
+  int end = TileRow::Size)
+{
+  line = inputs.line;
+  ubyte_t row[TileRow::Size];
+  for (int i = 0; i < rounds; i++) {
+    ulong_t bits = inputs.bits[i % inputs.bits.size()];
+    bool xflip = (i & 1) != 0;
+    ubyte_t attr = ubyte_t(i << 4) & 0x70;
+    ubyte_t keep = ubyte_t(i & 2) << 6;
+    ubyte_t* dst =
+      line.data() + (i % (LineSize / TileRow::Size)) * TileRow::Size;
+    if (per_pixel) {
+      draw_row_per_pixel(bits, xflip, attr, keep, dst, begin, end);
+    } else {
+      TileRow::expand(bits, xflip, row);
+      TileRow::blend(row, attr, keep, dst, begin, end);
+    }
+  }
+}
+
+// Checks the kernels against the per pixel code, for whole and clipped rows,
+// and the frames rendered with each kernel against the scalar one. Returns
+// the number of mismatches.
+int check_kernels()
+{
+  auto inputs = RowInputs::make();
+  auto initial = TileRow::kernel();
+  int mismatches = 0;
+  std::vector<ubyte_t> expected, got;
+  std::vector<ubyte_t> scalar_frame;
+  for (auto kernel : Kernels) {
+    if (!TileRow::set_kernel(kernel)) { continue; }
+    for (auto [begin, end] : Clips) {
+      draw_rows(inputs, expected, 4096, true, begin, end);
+      draw_rows(inputs, got, 4096, false, begin, end);
+      if (expected != got) {
+        P("$: rows [$, $[ differ from the per pixel code",
+          TileRow::to_string(kernel),
+          begin,
+          end);
+        mismatches++;
+      }
+    }
+
+    // A new VDP, so the tiles are decoded with this kernel too
+    auto vdp = make_vdp();
+    const auto& pixels = vdp->render().pixels;
+    std::vector<ubyte_t> frame(pixels.begin(), pixels.end());
+    if (scalar_frame.empty()) {
+      scalar_frame = frame;
+    } else if (frame != scalar_frame) {
+      P("$: frame differs from the scalar one", TileRow::to_string(kernel));
+      mismatches++;
+    }
+  }
+  TileRow::set_kernel(initial);
+  return mismatches;
+}
+
+void bench_rows(bool per_pixel)
+{
+  auto inputs = RowInputs::make();
+  std::vector<ubyte_t> line;
+
+  auto start = bee::Time::now();
+  draw_rows(inputs, line, RowRounds, per_pixel);
+  auto elapsed = bee::Time::now() - start;
+
+  bee::SimpleChecksum cs;
+  cs.add_string(reinterpret_cast<const char*>(line.data()), line.size());
+  P("  row: $ ns/row (checksum $)",
+    elapsed.to_float_seconds() * 1e9 / RowRounds,
+    cs.hex());
+}
+
+void bench_expand()
+{
+  std::mt19937 gen(42);
+  std::vector<ulong_t> rows(256);
+  for (auto& r : rows) { r = gen(); }
+  ubyte_t out[TileRow::Size];
+  ulong_t sum = 0;
+
+  auto start = bee::Time::now();
+  for (int i = 0; i < RowRounds; i++) {
+    TileRow::expand(rows[i % rows.size()], (i & 1) != 0, out);
+    sum += out[i % TileRow::Size];
+  }
+  auto elapsed = bee::Time::now() - start;
+
+  P("  expand: $ ns/row (checksum {x})",
+    elapsed.to_float_seconds() * 1e9 / RowRounds,
+    sum);
+}
+
+void bench_blend()
+{
+  std::mt19937 gen(42);
+  std::vector<ubyte_t> rows(TileRow::Size * 256);
+  for (auto& p : rows) { p = gen() & 0xf; }
+  std::vector<ubyte_t> line(LineSize, 0);
+
+  auto start = bee::Time::now();
+  for (int i = 0; i < RowRounds; i++) {
+    const ubyte_t* row = rows.data() + (i % 256) * TileRow::Size;
+    ubyte_t* dst =
+      line.data() + (i % (LineSize / TileRow::Size)) * TileRow::Size;
+    TileRow::blend(row, ubyte_t(i << 4), ubyte_t((i & 1) << 7), dst);
+  }
+  auto elapsed = bee::Time::now() - start;
+
+  bee::SimpleChecksum cs;
+  cs.add_string(reinterpret_cast<const char*>(line.data()), line.size());
+  P("  blend: $ ns/row (checksum $)",
+    elapsed.to_float_seconds() * 1e9 / RowRounds,
+    cs.hex());
+}
+
+void bench_render(VDP& vdp)
+{
+  // The first frame decodes the tiles into the cache, so this is mostly the
+  // compositing
+  vdp.render();
+
+  auto start = bee::Time::now();
+  for (int i = 0; i < Frames; i++) { vdp.render(); }
+  auto elapsed = bee::Time::now() - start;
+  P("  render: $ us/frame", elapsed.to_float_seconds() * 1e6 / Frames);
+
+  const auto& frame = vdp.render();
+  start = bee::Time::now();
+  for (int i = 0; i < Frames - 1; i++) { frame.to_image(); }
+  auto img = frame.to_image();
+  elapsed = bee::Time::now() - start;
+
+  bee::SimpleChecksum cs;
+  cs.add_string(reinterpret_cast<const char*>(img.data()), img.data_size());
+  P("  to_image: $ us/frame (checksum $)",
+    elapsed.to_float_seconds() * 1e6 / Frames,
+    cs.hex());
+}
+
+int main()
+{
+  if (int mismatches = check_kernels(); mismatches > 0) {
+    P("$ mismatches between the kernels", mismatches);
+    return 1;
+  }
+  P("All kernels match the per pixel code");
+
+  P("per pixel:");
+  bench_rows(true);
+
+  auto vdp = make_vdp();
+  for (auto kernel : Kernels) {
+    P("$:", TileRow::to_string(kernel));
+    if (!TileRow::set_kernel(kernel)) {
+      P("  not supported");
+      continue;
+    }
+    bench_rows(false);
+    bench_expand();
+    bench_blend();
+    bench_render(*vdp);
+  }
+  return 0;
+}
+
+} // namespace
+} // namespace heaven_ice
+
+int main() { return heaven_ice::main(); }
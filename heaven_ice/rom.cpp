@@ -0,0 +1,43 @@
+#include "rom.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace heaven_ice {
+
+Rom::Rom(const ubyte_t* data, size_t size) : _data(data), _size(size) {}
+
+Rom::~Rom() { munmap(const_cast<ubyte_t*>(_data), _size); }
+
+bee::OrError<Rom::ptr> Rom::open(const bee::FilePath& path)
+{
+  int fd = ::open(path.to_std_string().c_str(), O_RDONLY);
+  if (fd < 0) {
+    return EF("Failed to open rom $: $", path, strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    auto err = errno;
+    close(fd);
+    return EF("Failed to stat rom $: $", path, strerror(err));
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return EF("Rom is empty: $", path);
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  auto err = errno;
+  close(fd);
+  if (data == MAP_FAILED) {
+    return EF("Failed to map rom $: $", path, strerror(err));
+  }
+  return ptr(new Rom(reinterpret_cast<const ubyte_t*>(data), size));
+}
+
+} // namespace heaven_ice
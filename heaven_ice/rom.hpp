@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <span>
+
+#include "types.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace heaven_ice {
+
+// Immutable ROM image mapped read only from the rom file. All the Memory
+// instances viewing it share the same pages without copying.
+struct Rom {
+ public:
+  using ptr = std::shared_ptr<const Rom>;
+
+  ~Rom();
+
+  Rom(const Rom&) = delete;
+  Rom& operator=(const Rom&) = delete;
+
+  static bee::OrError<ptr> open(const bee::FilePath& path);
+
+  std::span<const ubyte_t> data() const { return {_data, _size}; }
+
+  size_t size() const { return _size; }
+
+ private:
+  Rom(const ubyte_t* data, size_t size);
+
+  const ubyte_t* _data;
+  size_t _size;
+};
+
+} // namespace heaven_ice
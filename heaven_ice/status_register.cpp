@@ -1,5 +1,7 @@
 #include "status_register.hpp"
 
+#include "save_state.hpp"
+
 #include "bee/format.hpp"
 #include "bee/or_error.hpp"
 
@@ -41,6 +43,7 @@ StatusRegister::StatusRegister() {}
 
 int StatusRegister::to_int() const
 {
+  _flush();
   int output = _int_priority_mask << 8;
   if (_carry == SRV::Set) output |= 1;
   if (_ov == SRV::Set) output |= 2;
@@ -52,16 +55,18 @@ int StatusRegister::to_int() const
 
 void StatusRegister::set_from_int(int value)
 {
-  set_carry((value & 1) != 0);
-  set_ov((value & 2) != 0);
-  set_zero((value & 4) != 0);
-  set_neg((value & 8) != 0);
-  set_ext((value & 16) != 0);
+  set_flags(
+    (value & 16) != 0,
+    (value & 8) != 0,
+    (value & 4) != 0,
+    (value & 2) != 0,
+    (value & 1) != 0);
   _int_priority_mask = (value >> 8) & 7;
 }
 
 std::string StatusRegister::to_string() const
 {
+  _flush();
   std::string str;
   str += format_value(_ext, 'x');
   str += format_value(_neg, 'n');
@@ -73,28 +78,80 @@ std::string StatusRegister::to_string() const
   return str;
 }
 
-void StatusRegister::set_zero(bool value) { _zero = of_bool(value); }
+void StatusRegister::set_zero(bool value)
+{
+  _flush();
+  _zero = of_bool(value);
+}
+
+void StatusRegister::set_ext(bool value)
+{
+  _flush();
+  _ext = of_bool(value);
+}
 
-void StatusRegister::set_ext(bool value) { _ext = of_bool(value); }
+void StatusRegister::set_neg(bool value)
+{
+  _flush();
+  _neg = of_bool(value);
+}
 
-void StatusRegister::set_neg(bool value) { _neg = of_bool(value); }
+void StatusRegister::set_ov(bool value)
+{
+  _flush();
+  _ov = of_bool(value);
+}
 
-void StatusRegister::set_ov(bool value) { _ov = of_bool(value); }
+void StatusRegister::set_carry(bool value)
+{
+  _flush();
+  _carry = of_bool(value);
+}
 
-void StatusRegister::set_carry(bool value) { _carry = of_bool(value); }
+void StatusRegister::set_flags(
+  bool ext, bool neg, bool zero, bool ov, bool carry)
+{
+  _lazy_op = LazyOp::None;
+  _ext = of_bool(ext);
+  _neg = of_bool(neg);
+  _zero = of_bool(zero);
+  _ov = of_bool(ov);
+  _carry = of_bool(carry);
+}
 
-bool StatusRegister::ext() const { return to_bool(_ext); }
+bool StatusRegister::ext() const
+{
+  _flush();
+  return to_bool(_ext);
+}
 
-bool StatusRegister::neg() const { return to_bool(_neg); }
+bool StatusRegister::neg() const
+{
+  _flush();
+  return to_bool(_neg);
+}
 
-bool StatusRegister::zero() const { return to_bool(_zero); }
+bool StatusRegister::zero() const
+{
+  _flush();
+  return to_bool(_zero);
+}
 
-bool StatusRegister::ov() const { return to_bool(_ov); }
+bool StatusRegister::ov() const
+{
+  _flush();
+  return to_bool(_ov);
+}
 
-bool StatusRegister::carry() const { return to_bool(_carry); }
+bool StatusRegister::carry() const
+{
+  _flush();
+  return to_bool(_carry);
+}
 
 bool StatusRegister::check_condition(Condition cond) const
 {
+  _flush();
   switch (cond) {
   case Condition::True:
     return true;
@@ -126,6 +183,72 @@ bool StatusRegister::check_condition(Condition cond) const
 }
 
 void StatusRegister::invalidate_cc()
+{
+  _lazy_op = LazyOp::None;
+  _invalidate_flags();
+}
+
+bool StatusRegister::operator==(const StatusRegister& other) const
+{
+  _flush();
+  other._flush();
+  return _ext == other._ext && _neg == other._neg && _zero == other._zero &&
+         _ov == other._ov && _carry == other._carry &&
+         _int_priority_mask == other._int_priority_mask;
+}
+
+void StatusRegister::save_state(bee::Writer& writer) const
+{
+  _flush();
+  save_state_gen(_ext, writer);
+  save_state_gen(_neg, writer);
+  save_state_gen(_zero, writer);
+  save_state_gen(_ov, writer);
+  save_state_gen(_carry, writer);
+  save_state_gen(_int_priority_mask, writer);
+}
+
+void StatusRegister::load_state(bee::Reader& reader)
+{
+  _lazy_op = LazyOp::None;
+  load_state_gen(_ext, reader);
+  load_state_gen(_neg, reader);
+  load_state_gen(_zero, reader);
+  load_state_gen(_ov, reader);
+  load_state_gen(_carry, reader);
+  load_state_gen(_int_priority_mask, reader);
+}
+
+void StatusRegister::_materialize() const
+{
+  ulong_t mask = _lazy_msb | (_lazy_msb - 1);
+  ulong_t res = _lazy_res & mask;
+  switch (_lazy_op) {
+  case LazyOp::None:
+    break;
+  case LazyOp::Tst:
+    _neg = of_bool((res & _lazy_msb) != 0);
+    _zero = of_bool(res == 0);
+    _ov = SRV::Clear;
+    _carry = SRV::Clear;
+    break;
+  case LazyOp::Cmp: {
+    ulong_t dst = _lazy_dst & mask;
+    ulong_t src = _lazy_src & mask;
+    _neg = of_bool((res & _lazy_msb) != 0);
+    _zero = of_bool(res == 0);
+    _ov = of_bool(((dst ^ src) & (dst ^ res) & _lazy_msb) != 0);
+    _carry = of_bool(dst < src);
+  } break;
+  case LazyOp::Zero:
+    _invalidate_flags();
+    _zero = of_bool(res == 0);
+    break;
+  }
+  _lazy_op = LazyOp::None;
+}
+
+void StatusRegister::_invalidate_flags() const
 {
   _ext = SRV::Invalid;
   _neg = SRV::Invalid;
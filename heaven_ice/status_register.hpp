@@ -3,6 +3,10 @@
 #include <string>
 
 #include "condition.hpp"
+#include "types.hpp"
+
+#include "bee/reader.hpp"
+#include "bee/writer.hpp"
 
 namespace heaven_ice {
 
@@ -17,12 +21,18 @@ struct StatusRegister {
 
   std::string to_string() const;
 
+  // Setting a single flag keeps the others, so a pending lazy op is flushed
+  // first
   void set_zero(bool value);
   void set_ext(bool value);
   void set_neg(bool value);
   void set_ov(bool value);
   void set_carry(bool value);
 
+  // Overwrites all five flags, a pending lazy op is dropped without being
+  // flushed
+  void set_flags(bool ext, bool neg, bool zero, bool ov, bool carry);
+
   bool ext() const;
   bool neg() const;
   bool zero() const;
@@ -31,20 +41,75 @@ struct StatusRegister {
 
   void invalidate_cc();
 
+  // The flags of the most common operations are not computed until they are
+  // read, only the operands are recorded.
+
+  // N and Z from the value, V and C cleared
+  template <class T> inline void set_tst(T value)
+  {
+    _set_lazy(LazyOp::Tst, msb<T>(), value);
+  }
+
+  // Flags of dst - src = res
+  template <class T> inline void set_cmp(T dst, T src, T res)
+  {
+    _set_lazy(LazyOp::Cmp, msb<T>(), res);
+    _lazy_dst = dst;
+    _lazy_src = src;
+  }
+
+  // Z from the value, all other flags invalid
+  template <class T> inline void set_zero_only(T value)
+  {
+    _set_lazy(LazyOp::Zero, msb<T>(), value);
+  }
+
   int int_priority_mask() const { return _int_priority_mask; }
 
-  auto operator<=>(const StatusRegister& other) const = default;
+  bool operator==(const StatusRegister& other) const;
 
   bool check_condition(Condition cond) const;
 
- private:
-  void _assert_cc_valid() const;
+  // Pending flags are materialized first, the layout is the same as before
+  // the flags were evaluated lazily
+  void save_state(bee::Writer& writer) const;
+  void load_state(bee::Reader& reader);
 
-  StatusRegisterValue _ext = StatusRegisterValue::Clear;
-  StatusRegisterValue _neg = StatusRegisterValue::Clear;
-  StatusRegisterValue _zero = StatusRegisterValue::Clear;
-  StatusRegisterValue _ov = StatusRegisterValue::Clear;
-  StatusRegisterValue _carry = StatusRegisterValue::Clear;
+ private:
+  enum class LazyOp : ubyte_t { None, Tst, Cmp, Zero };
+
+  template <class T> static constexpr ulong_t msb()
+  {
+    return ulong_t(1) << (sizeof(T) * 8 - 1);
+  }
+
+  inline void _set_lazy(LazyOp op, ulong_t msb, ulong_t res)
+  {
+    _lazy_op = op;
+    _lazy_msb = msb;
+    _lazy_res = res;
+  }
+
+  inline void _flush() const
+  {
+    if (_lazy_op != LazyOp::None) { _materialize(); }
+  }
+
+  void _materialize() const;
+
+  void _invalidate_flags() const;
+
+  mutable StatusRegisterValue _ext = StatusRegisterValue::Clear;
+  mutable StatusRegisterValue _neg = StatusRegisterValue::Clear;
+  mutable StatusRegisterValue _zero = StatusRegisterValue::Clear;
+  mutable StatusRegisterValue _ov = StatusRegisterValue::Clear;
+  mutable StatusRegisterValue _carry = StatusRegisterValue::Clear;
+
+  mutable LazyOp _lazy_op = LazyOp::None;
+  ulong_t _lazy_msb = 0;
+  ulong_t _lazy_res = 0;
+  ulong_t _lazy_dst = 0;
+  ulong_t _lazy_src = 0;
 
   int _int_priority_mask = 0;
 };
@@ -0,0 +1,151 @@
+#include "status_register.hpp"
+
+#include "bee/or_error.hpp"
+#include "bee/testing.hpp"
+
+namespace heaven_ice {
+namespace {
+
+void print_flags(const StatusRegister& sr)
+{
+  auto flag = [](auto&& fn) -> std::string {
+    try {
+      return fn() ? "1" : "0";
+    } catch (const bee::Exn&) {
+      return "raised";
+    }
+  };
+  P("ext:$ neg:$ zero:$ ov:$ carry:$",
+    flag([&] { return sr.ext(); }),
+    flag([&] { return sr.neg(); }),
+    flag([&] { return sr.zero(); }),
+    flag([&] { return sr.ov(); }),
+    flag([&] { return sr.carry(); }));
+}
+
+TEST(tst)
+{
+  auto run_test = [](auto value) {
+    StatusRegister sr;
+    sr.set_ext(true);
+    sr.set_ov(true);
+    sr.set_carry(true);
+    sr.set_tst(value);
+    P("tst($) -> $", value, sr);
+  };
+  run_test(sbyte_t(0));
+  run_test(sbyte_t(1));
+  run_test(sbyte_t(-1));
+  run_test(sbyte_t(127));
+  run_test(sbyte_t(-128));
+  run_test(sword_t(0));
+  run_test(sword_t(0x7fff));
+  run_test(sword_t(-32768));
+  run_test(slong_t(0));
+  run_test(slong_t(0x7fffffff));
+  run_test(slong_t(-1));
+}
+
+TEST(cmp)
+{
+  auto run_test = [](auto dst, auto src) {
+    using T = decltype(dst);
+    StatusRegister sr;
+    sr.set_cmp<T>(dst, src, dst - src);
+    P("$ - $ -> $", dst, src, sr);
+  };
+  run_test(sbyte_t(0), sbyte_t(0));
+  run_test(sbyte_t(0), sbyte_t(1));
+  run_test(sbyte_t(1), sbyte_t(0));
+  run_test(sbyte_t(-128), sbyte_t(1));
+  run_test(sbyte_t(127), sbyte_t(-1));
+  run_test(sbyte_t(-1), sbyte_t(1));
+  run_test(sbyte_t(1), sbyte_t(-1));
+  run_test(sbyte_t(-128), sbyte_t(127));
+  run_test(sword_t(0), sword_t(1));
+  run_test(sword_t(-32768), sword_t(1));
+  run_test(sword_t(32767), sword_t(-1));
+  run_test(sword_t(-1), sword_t(-1));
+  run_test(slong_t(0), slong_t(1));
+  run_test(slong_t(-2147483647 - 1), slong_t(1));
+  run_test(slong_t(2147483647), slong_t(-1));
+  run_test(slong_t(5), slong_t(3));
+}
+
+TEST(zero_only)
+{
+  auto run_test = [](auto value) {
+    StatusRegister sr;
+    sr.set_zero_only(value);
+    P("zero_only($) -> $", value, sr);
+    print_flags(sr);
+    P("eq:$ ne:$",
+      sr.check_condition(Condition::EQ) ? 1 : 0,
+      sr.check_condition(Condition::NE) ? 1 : 0);
+  };
+  run_test(sbyte_t(0));
+  run_test(sword_t(0x100));
+  run_test(slong_t(0x10000));
+}
+
+TEST(invalid)
+{
+  StatusRegister sr;
+  sr.set_from_int(0x1f);
+  sr.invalidate_cc();
+  P(sr);
+  print_flags(sr);
+  try {
+    sr.check_condition(Condition::CS);
+    P("CS did not raise");
+  } catch (const bee::Exn&) {
+    P("CS raised");
+  }
+  sr.set_zero(true);
+  sr.set_carry(false);
+  P(sr);
+  print_flags(sr);
+}
+
+TEST(partial_update)
+{
+  StatusRegister sr;
+  sr.set_ext(true);
+  sr.set_cmp<sbyte_t>(0, 1, -1);
+  sr.set_zero(true);
+  P(sr);
+  sr.set_tst<sword_t>(0);
+  sr.set_neg(true);
+  P(sr);
+  sr.set_tst<slong_t>(-1);
+  sr.set_from_int(0x0715);
+  P("$ $", sr, sr.to_int());
+  sr.set_cmp<sword_t>(1, 2, -1);
+  P("$ $", sr, sr.to_int());
+}
+
+TEST(set_flags)
+{
+  StatusRegister sr;
+  sr.set_cmp<sbyte_t>(0, 1, -1);
+  sr.set_flags(true, false, true, false, true);
+  P(sr);
+  sr.set_tst<sword_t>(0);
+  sr.set_from_int(0x0208);
+  P("$ $", sr, sr.to_int());
+}
+
+TEST(compare)
+{
+  StatusRegister lazy;
+  lazy.set_cmp<sbyte_t>(0, 1, -1);
+  StatusRegister eager;
+  eager.set_neg(true);
+  eager.set_carry(true);
+  P("lazy == eager: $", lazy == eager ? "true" : "false");
+  eager.set_zero(true);
+  P("lazy == eager: $", lazy == eager ? "true" : "false");
+}
+
+} // namespace
+} // namespace heaven_ice
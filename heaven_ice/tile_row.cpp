@@ -0,0 +1,159 @@
+#include "tile_row.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace heaven_ice {
+namespace {
+
+using ExpandFn = void (*)(ulong_t bits, bool xflip, ubyte_t* out);
+using BlendFn =
+  void (*)(const ubyte_t* row, ubyte_t attr, ubyte_t keep, ubyte_t* dst);
+
+struct Kernels {
+  TileRow::Kernel kind;
+  ExpandFn expand;
+  BlendFn blend;
+};
+
+void expand_scalar(ulong_t bits, bool xflip, ubyte_t* out)
+{
+  for (int x = 0; x < TileRow::Size; x++) {
+    ubyte_t color = (bits >> ((TileRow::Size - 1 - x) * 4)) & 0xf;
+    out[xflip ? TileRow::Size - 1 - x : x] = color;
+  }
+}
+
+void blend_pixel(ubyte_t color, ubyte_t attr, ubyte_t keep, ubyte_t& dst)
+{
+  if (color == 0 || (dst & keep) != 0) { return; }
+  dst = color | attr;
+}
+
+void blend_scalar(const ubyte_t* row, ubyte_t attr, ubyte_t keep, ubyte_t* dst)
+{
+  for (int x = 0; x < TileRow::Size; x++) {
+    blend_pixel(row[x], attr, keep, dst[x]);
+  }
+}
+
+constexpr Kernels ScalarKernels = {
+  .kind = TileRow::Kernel::Scalar,
+  .expand = expand_scalar,
+  .blend = blend_scalar,
+};
+
+#if defined(__x86_64__)
+
+__attribute__((target("ssse3"))) void expand_ssse3(
+  ulong_t bits, bool xflip, ubyte_t* out)
+{
+  __m128i v = _mm_cvtsi32_si128(int(bits));
+  __m128i nibble = _mm_set1_epi8(0xf);
+  __m128i lo = _mm_and_si128(v, nibble);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+  // The low byte of bits holds the last two pixels, so after interleaving the
+  // pixels are 6 7 4 5 2 3 0 1
+  __m128i pixels = _mm_unpacklo_epi8(hi, lo);
+  __m128i order =
+    xflip ? _mm_setr_epi8(
+              1, 0, 3, 2, 5, 4, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1)
+          : _mm_setr_epi8(
+              6, 7, 4, 5, 2, 3, 0, 1, -1, -1, -1, -1, -1, -1, -1, -1);
+  _mm_storel_epi64(
+    reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(pixels, order));
+}
+
+__attribute__((target("ssse3"))) void blend_ssse3(
+  const ubyte_t* row, ubyte_t attr, ubyte_t keep, ubyte_t* dst)
+{
+  __m128i src = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row));
+  __m128i cur = _mm_loadl_epi64(reinterpret_cast<__m128i*>(dst));
+  __m128i zero = _mm_setzero_si128();
+  __m128i transparent = _mm_cmpeq_epi8(src, zero);
+  __m128i free =
+    _mm_cmpeq_epi8(_mm_and_si128(cur, _mm_set1_epi8(char(keep))), zero);
+  __m128i mask = _mm_andnot_si128(transparent, free);
+  __m128i pixels = _mm_or_si128(src, _mm_set1_epi8(char(attr)));
+  __m128i out =
+    _mm_or_si128(_mm_and_si128(mask, pixels), _mm_andnot_si128(mask, cur));
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), out);
+}
+
+constexpr Kernels SSSE3Kernels = {
+  .kind = TileRow::Kernel::SSSE3,
+  .expand = expand_ssse3,
+  .blend = blend_ssse3,
+};
+
+#endif
+
+const Kernels* find_kernels(TileRow::Kernel kernel)
+{
+  switch (kernel) {
+  case TileRow::Kernel::Scalar:
+    return &ScalarKernels;
+  case TileRow::Kernel::SSSE3:
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3")) { return &SSSE3Kernels; }
+#endif
+    return nullptr;
+  }
+}
+
+const Kernels* best_kernels()
+{
+  if (auto k = find_kernels(TileRow::Kernel::SSSE3); k != nullptr) {
+    return k;
+  }
+  return &ScalarKernels;
+}
+
+const Kernels* kernels = best_kernels();
+
+} // namespace
+
+void TileRow::expand(ulong_t bits, bool xflip, ubyte_t* out)
+{
+  kernels->expand(bits, xflip, out);
+}
+
+void TileRow::blend(
+  const ubyte_t* row,
+  ubyte_t attr,
+  ubyte_t keep,
+  ubyte_t* dst,
+  int begin,
+  int end)
+{
+  if (begin == 0 && end == Size) [[likely]] {
+    kernels->blend(row, attr, keep, dst);
+    return;
+  }
+  for (int x = begin; x < end; x++) {
+    blend_pixel(row[x], attr, keep, dst[x - begin]);
+  }
+}
+
+bool TileRow::set_kernel(Kernel kernel)
+{
+  auto k = find_kernels(kernel);
+  if (k == nullptr) { return false; }
+  kernels = k;
+  return true;
+}
+
+TileRow::Kernel TileRow::kernel() { return kernels->kind; }
+
+const char* TileRow::to_string(Kernel kernel)
+{
+  switch (kernel) {
+  case Kernel::Scalar:
+    return "scalar";
+  case Kernel::SSSE3:
+    return "ssse3";
+  }
+}
+
+} // namespace heaven_ice
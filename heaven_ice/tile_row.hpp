@@ -0,0 +1,43 @@
+#pragma once
+
+#include "types.hpp"
+
+namespace heaven_ice {
+
+// Kernels for one 8 pixel row of a tile. A decoded pixel is one byte, the low
+// nibble is the color and color 0 is transparent. There is a scalar and an
+// SSSE3 version of each, the one to use is picked at startup from what the CPU
+// supports.
+struct TileRow {
+ public:
+  enum class Kernel {
+    Scalar,
+    SSSE3,
+  };
+
+  static constexpr int Size = 8;
+
+  // Unpacks a row as stored in VRAM, leftmost pixel in the high nibble, to out.
+  // The row is mirrored if xflip is set.
+  static void expand(ulong_t bits, bool xflip, ubyte_t* out);
+
+  // Draws the pixels of row in [begin, end[ ORed with attr to dst, which is
+  // where pixel begin goes. Transparent pixels and dst pixels with a bit of
+  // keep set are left alone. An unclipped row is blended with a single store.
+  static void blend(
+    const ubyte_t* row,
+    ubyte_t attr,
+    ubyte_t keep,
+    ubyte_t* dst,
+    int begin = 0,
+    int end = Size);
+
+  // Overrides the kernel picked at startup, for benchmarking. Returns false
+  // and leaves it unchanged if the CPU doesn't support it.
+  static bool set_kernel(Kernel kernel);
+  static Kernel kernel();
+
+  static const char* to_string(Kernel kernel);
+};
+
+} // namespace heaven_ice
@@ -1,6 +1,12 @@
 #include "to_cpp.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <exception>
 #include <set>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "addr_mode.hpp"
@@ -10,15 +16,22 @@
 #include "memory.hpp"
 #include "register_id.hpp"
 
+#include "bee/file_path.hpp"
+#include "bee/file_reader.hpp"
+#include "bee/file_writer.hpp"
+#include "bee/filesystem.hpp"
 #include "bee/format_vector.hpp"
 #include "bee/print.hpp"
 #include "bee/sort.hpp"
 #include "bee/string_util.hpp"
+#include "bee/time.hpp"
 #include "heaven_ice/instruction.hpp"
 
 namespace heaven_ice {
 namespace {
 
+constexpr ulong_t AddrMask = 0xffffff;
+
 const char* size_letter(SizeKind size)
 {
   switch (size) {
@@ -55,11 +68,25 @@ std::string reg_name(const RegisterId& reg)
   }
 }
 
-std::string reg_value(SizeKind size, const RegisterId& reg)
+// Generated functions keep the data and address registers they use in locals,
+// which are only synced with G around calls and at the exit
+std::string local_reg_name(const RegisterId& reg)
+{
+  switch (reg.kind) {
+  case RegisterKind::Data:
+    return F("d$", reg.reg_id);
+  case RegisterKind::Addr:
+    return F("a$", reg.reg_id);
+  case RegisterKind::SR:
+    return "G.sr";
+  }
+}
+
+std::string reg_value(
+  SizeKind size, const RegisterId& reg, const std::string& name)
 {
-  auto name = reg_name(reg);
   if (reg.kind == RegisterKind::Addr && size == SizeKind::l()) {
-    return reg_name(reg);
+    return name;
   }
   switch (reg.kind) {
   case RegisterKind::Addr:
@@ -73,7 +100,7 @@ std::string reg_value(SizeKind size, const RegisterId& reg)
 std::string write_register(
   SizeKind size, const RegisterId& reg, const std::string& value)
 {
-  auto name = reg_name(reg);
+  auto name = local_reg_name(reg);
   switch (reg.kind) {
   case RegisterKind::Addr:
   case RegisterKind::Data:
@@ -165,12 +192,15 @@ struct Arg {
   static Arg aw(int idx) { return {SizeKind::Word, RegisterId::addr(idx)}; }
   static Arg al(int idx) { return {SizeKind::Long, RegisterId::addr(idx)}; }
 
-  std::string value_code() const { return reg_value(size, reg); }
+  std::string value_code() const
+  {
+    return reg_value(size, reg, reg_name(reg));
+  }
 };
 
 struct Function {
   ulong_t start;
-  bool skip_inlining = true;
+  bool skip_inlining = false;
   std::optional<std::string> manual_name;
   std::vector<Instruction> insts;
   std::vector<Arg> args;
@@ -204,14 +234,49 @@ struct Function {
 
 std::map<ulong_t, Function> functions;
 
-std::optional<Function> find_function(ulong_t addr)
+// Addresses indirect jumps are known to land on, mapped to the function that
+// handles them
+std::map<ulong_t, ulong_t> jump_map;
+
+// A run of jump instructions, step bytes apart, that code jumps into with an
+// indexed address like JMP (A0,D0.W). Each one gets a static array of handlers
+// so dispatching into it is a single indirect call.
+struct JumpTable {
+  ulong_t base;
+  ulong_t end;
+  ulong_t step;
+
+  ulong_t size() const { return (end - base) / step + 1; }
+
+  bool in_range(ulong_t addr) const { return addr >= base && addr <= end; }
+
+  bool contains(ulong_t addr) const
+  {
+    return in_range(addr) && (addr - base) % step == 0;
+  }
+
+  std::string name() const { return F("JUMP_TABLE_{x}", base); }
+  std::string array_name() const { return F("_jump_table_{x}", base); }
+};
+
+std::vector<JumpTable> jump_tables;
+
+std::optional<JumpTable> find_jump_table(ulong_t addr)
 {
-  if (auto it = functions.find(addr); it != functions.end()) {
-    return it->second;
+  for (const auto& table : jump_tables) {
+    if (table.in_range(addr)) { return table; }
   }
   return std::nullopt;
 }
 
+const Function* find_function(ulong_t addr)
+{
+  if (auto it = functions.find(addr); it != functions.end()) {
+    return &it->second;
+  }
+  return nullptr;
+}
+
 struct Code {
  public:
   template <class T> void add_line(T&& line)
@@ -232,8 +297,20 @@ struct Code {
 
   const std::vector<std::string>& lines() const { return _lines; }
 
+  void append(Code&& other)
+  {
+    for (auto& line : other._lines) { _lines.push_back(std::move(line)); }
+  }
+
   void set_comment_out(bool comment_out) { _comment_out = comment_out; }
 
+  // Prints the lines added so far to stdout and drops them
+  void flush_to_stdout()
+  {
+    for (const auto& line : _lines) { P(line); }
+    _lines.clear();
+  }
+
  private:
   std::vector<std::string> _lines;
 
@@ -261,6 +338,7 @@ struct ExpressionKind {
     Sub,
     Label,
     Comment,
+    Loop,
   };
 
   ExpressionKind(E e) : _e(e) {}
@@ -291,6 +369,7 @@ struct ExpressionKind {
       _(Sub);
       _(Label);
       _(Comment);
+      _(Loop);
     }
 
 #undef _
@@ -374,6 +453,109 @@ struct SizedVariable {
   bool operator==(const SizedVariable& rhs) const = default;
 };
 
+// Name of the variant of an inst_impls operation that doesn't update the
+// condition codes, if there's one
+std::optional<std::string> flag_free_name(const std::string& name)
+{
+  constexpr const char* ops[] = {
+    "ADD",  "AND",  "ASL",  "ASR",  "BCHG", "BCLR", "BSET", "DIVS", "DIVU",
+    "EOR",  "LSL",  "LSR",  "MULS", "MULU", "NEG",  "NOT",  "OR",   "ROL",
+    "ROR",  "SUB",
+  };
+  auto pos = name.find('<');
+  auto op = name.substr(0, pos);
+  for (const auto& o : ops) {
+    if (op == o) {
+      return F("$_NF$", op, pos == std::string::npos ? "" : name.substr(pos));
+    }
+  }
+  return std::nullopt;
+}
+
+// The data and address registers a generated function uses
+struct PromotedRegs {
+  static constexpr int NumRegs = 16;
+
+  std::array<bool, NumRegs> used{};
+  std::array<bool, NumRegs> written{};
+
+  void use(const RegisterId& reg)
+  {
+    if (auto idx = index(reg); idx) { used.at(*idx) = true; }
+  }
+
+  void write(const RegisterId& reg)
+  {
+    if (auto idx = index(reg); idx) { written.at(*idx) = true; }
+  }
+
+  static std::optional<int> index(const RegisterId& reg)
+  {
+    switch (reg.kind) {
+    case RegisterKind::Data:
+      return reg.reg_id;
+    case RegisterKind::Addr:
+      return 8 + reg.reg_id;
+    case RegisterKind::SR:
+      return std::nullopt;
+    }
+  }
+
+  static RegisterId reg(int idx)
+  {
+    return idx < 8 ? RegisterId::data(idx) : RegisterId::addr(idx - 8);
+  }
+};
+
+// Values of the data and address registers known at some point of the
+// straight line code, as the full 32 bits of the register
+struct KnownRegs {
+  std::array<std::optional<ulong_t>, PromotedRegs::NumRegs> values{};
+
+  std::optional<slong_t> get(const SizedReg& r) const
+  {
+    auto idx = PromotedRegs::index(r.reg);
+    if (!idx.has_value() || !values.at(*idx).has_value()) {
+      return std::nullopt;
+    }
+    return SizedValue::make(r.size, *values.at(*idx)).value;
+  }
+
+  // Follows how the registers are written, address registers are always sign
+  // extended while data registers keep their upper bits
+  void set(const SizedReg& r, const std::optional<slong_t>& v)
+  {
+    auto idx = PromotedRegs::index(r.reg);
+    if (!idx.has_value()) { return; }
+    auto& value = values.at(*idx);
+    if (!v.has_value()) {
+      value = std::nullopt;
+    } else if (r.size == SizeKind::l() || r.reg.is_addr()) {
+      value = SizedValue::make(r.size, *v).value;
+    } else if (value.has_value()) {
+      ulong_t mask = r.size.mask();
+      value = (*value & ~mask) | (ulong_t(*v) & mask);
+    }
+  }
+
+  void forget(const PromotedRegs& regs)
+  {
+    for (int i = 0; i < PromotedRegs::NumRegs; i++) {
+      if (regs.written.at(i)) { values.at(i) = std::nullopt; }
+    }
+  }
+
+  void clear() { values.fill(std::nullopt); }
+};
+
+std::optional<SizeKind> size_of_stype(const std::string& name)
+{
+  for (auto size : {SizeKind::b(), SizeKind::w(), SizeKind::l()}) {
+    if (name == size.stype_name()) { return size; }
+  }
+  return std::nullopt;
+}
+
 struct Expression {
   ExpressionKind kind;
   std::optional<SizedValue> constant{};
@@ -386,6 +568,9 @@ struct Expression {
   std::optional<std::string> label_name{};
   std::optional<std::string> comment{};
 
+  // Calls into other 68k functions, which can read and write any register
+  bool calls_out = false;
+
   bool operator==(const Expression& rhs) const = default;
 
   template <class... T>
@@ -406,6 +591,17 @@ struct Expression {
     };
   }
 
+  static Expression make_fn_call(
+    const std::string& name, std::vector<Expression> args)
+  {
+    return {
+      .kind = ExpressionKind::Call,
+      .fn_name = name,
+      .args = std::move(args),
+      .calls_out = true,
+    };
+  }
+
   template <class... T>
     requires(std::is_same_v<std::decay_t<T>, Expression> && ...)
   static Expression make_seq(T&&... args)
@@ -458,6 +654,13 @@ struct Expression {
     };
   }
 
+  // A constant typed like a register read of the given size, B(), W() and L()
+  // are the signed types from inst_impls
+  static Expression make_cast(SizeKind size, slong_t v)
+  {
+    return make_call(size.stype_name(), make_const(size, v));
+  }
+
   static Expression make_reg(SizeKind size, const RegisterId& reg)
   {
     return {
@@ -537,6 +740,18 @@ struct Expression {
     };
   }
 
+  // Runs body count times, the remaining iterations are kept in the variable
+  // called name
+  template <class C, class B>
+  static Expression make_loop(const std::string& name, C&& count, B&& body)
+  {
+    return {
+      .kind = ExpressionKind::Loop,
+      .args = {std::forward<C>(count), std::forward<B>(body)},
+      .id = name,
+    };
+  }
+
   std::string to_string() const
   {
     switch (kind) {
@@ -568,6 +783,8 @@ struct Expression {
       return F("$:", label_name.value());
     case ExpressionKind::Comment:
       return comment.value();
+    case ExpressionKind::Loop:
+      return F("for $ {{ $ }", args.at(0), args.at(1));
     }
   }
 
@@ -587,6 +804,7 @@ struct Expression {
     case ExpressionKind::Sub:
     case ExpressionKind::Label:
     case ExpressionKind::Comment:
+    case ExpressionKind::Loop:
       return {to_string()};
     case ExpressionKind::Seq: {
       std::vector<std::string> lines;
@@ -621,13 +839,22 @@ struct Expression {
       return constant.value().to_cpp_hex();
     } break;
     case ExpressionKind::Ram: {
-      return F(
-        "G.io->$($)", size_letter(ram_size.value()), args.at(0).to_cpp_code());
+      auto size = ram_size.value();
+      if (auto accessor = direct_accessor(); accessor != nullptr) {
+        return F(
+          "G.io->$<$, Verbose>($)",
+          accessor,
+          size.stype_name(),
+          args.at(0).to_cpp_code());
+      }
+      return F("G.io->$($)", size_letter(size), args.at(0).to_cpp_code());
     } break;
     case ExpressionKind::Seq: {
       std::string lines;
       for (auto& a : args) {
-        if (a.kind == ExpressionKind::Comment || a.kind == ExpressionKind::If) {
+        if (
+          a.kind == ExpressionKind::Comment || a.kind == ExpressionKind::If ||
+          a.kind == ExpressionKind::Loop) {
           lines += F("$\n", a.to_cpp_code());
         } else {
           lines += F("$;\n", a.to_cpp_code());
@@ -650,37 +877,49 @@ struct Expression {
       auto& dst = args.at(0);
       auto& rhs = args.at(1);
       switch (dst.kind) {
-      case ExpressionKind::Ram:
+      case ExpressionKind::Ram: {
+        auto size = dst.ram_size.value();
+        if (auto accessor = dst.direct_accessor(); accessor != nullptr) {
+          return F(
+            "G.io->$<$, Verbose>($, $)",
+            accessor,
+            size.stype_name(),
+            dst.args.at(0).to_cpp_code(),
+            rhs.to_cpp_code());
+        }
         return F(
           "G.io->$($, $)",
-          size_letter(dst.ram_size.value()),
+          size_letter(size),
           dst.args.at(0).to_cpp_code(),
           rhs.to_cpp_code());
+      } break;
       case ExpressionKind::Reg: {
         auto&& r = dst.reg.value();
         const bool is_long_addr = r.size == SizeKind::l() && r.reg.is_addr();
         if (rhs.is_add() && rhs.args.at(0) == dst) {
           if (is_long_addr) {
-            return F("$ += $", reg_name(r.reg), rhs.args.at(1).to_cpp_code());
+            return F(
+              "$ += $", local_reg_name(r.reg), rhs.args.at(1).to_cpp_code());
           } else {
             return F(
               "$.inc<$>($)",
-              reg_name(r.reg),
+              local_reg_name(r.reg),
               uppercase_size_letter(r.size),
               rhs.args.at(1).to_cpp_code());
           }
         } else if (rhs.is_sub() && rhs.args.at(0) == dst) {
           if (is_long_addr) {
-            return F("$ -= $", reg_name(r.reg), rhs.args.at(1).to_cpp_code());
+            return F(
+              "$ -= $", local_reg_name(r.reg), rhs.args.at(1).to_cpp_code());
           } else {
             return F(
               "$.dec<$>($)",
-              reg_name(r.reg),
+              local_reg_name(r.reg),
               uppercase_size_letter(r.size),
               rhs.args.at(1).to_cpp_code());
           }
         } else if (is_long_addr) {
-          return F("$ = $", reg_name(r.reg), rhs.to_cpp_code());
+          return F("$ = $", local_reg_name(r.reg), rhs.to_cpp_code());
         } else {
           return write_register(r.size, r.reg, rhs.to_cpp_code());
         }
@@ -695,7 +934,7 @@ struct Expression {
     } break;
     case ExpressionKind::Reg: {
       const auto& r = reg.value();
-      return reg_value(r.size, r.reg);
+      return reg_value(r.size, r.reg, local_reg_name(r.reg));
     }
     case ExpressionKind::Goto:
       return F("goto $", args.at(0).to_cpp_code());
@@ -707,7 +946,231 @@ struct Expression {
       return F("\n$:", label_name.value());
     case ExpressionKind::Comment:
       return F("// $", comment.value());
+    case ExpressionKind::Loop: {
+      const auto& name = id.value();
+      return F(
+        "for (ulong_t $ = $; $ != 0; $--) {{\n$}",
+        name,
+        args.at(0).to_cpp_code(),
+        name,
+        name,
+        args.at(1).to_cpp_code());
+    } break;
+    }
+  }
+
+  // The address the bus decodes for this expression when it's a constant,
+  // truncated the same way the literal emitted for it is
+  std::optional<ulong_t> constant_address() const
+  {
+    if (!is_constant()) { return std::nullopt; }
+    ulong_t addr = 0;
+    switch (constant->size) {
+    case SizeKind::Byte:
+      addr = ubyte_t(constant->value);
+      break;
+    case SizeKind::Word:
+      addr = uword_t(constant->value);
+      break;
+    case SizeKind::Long:
+      addr = ulong_t(constant->value);
+      break;
+    }
+    return addr & AddrMask;
+  }
+
+  // For a Ram expression at a constant address, the bus accessor of the
+  // device it maps to, which skips the address decoding at runtime
+  const char* direct_accessor() const
+  {
+    auto addr = args.at(0).constant_address();
+    if (!addr.has_value()) { return nullptr; }
+    ulong_t end = *addr + ram_size->num_bytes();
+    if (*addr >= RAM_BEGIN && end <= RAM_END) {
+      return "ram";
+    } else if (*addr >= VDP_BEGIN && end <= VDP_END) {
+      return "vdp";
+    } else if (*addr >= CTRL_BEGIN && end <= CTRL_END) {
+      return "ctrl";
+    } else {
+      return nullptr;
+    }
+  }
+
+  // Reads from constant addresses in the rom can't change at runtime, so they
+  // are replaced by the value read at recompile time
+  Expression fold_rom_reads(Memory& rom) const
+  {
+    auto copy = *this;
+    if (kind == ExpressionKind::Assign && args.at(0).is_ram()) {
+      // The destination is written to, only its address can be folded
+      auto& dst_addr = copy.args.at(0).args.at(0);
+      dst_addr = dst_addr.fold_rom_reads(rom);
+      copy.args.at(1) = copy.args.at(1).fold_rom_reads(rom);
+      return copy;
+    }
+    for (auto& a : copy.args) { a = a.fold_rom_reads(rom); }
+    if (!is_ram()) { return copy; }
+    auto size = ram_size.value();
+    auto addr = copy.args.at(0).constant_address();
+    ulong_t rom_end = std::min<ulong_t>(rom.size(), ROM_END);
+    if (addr.has_value() && *addr + size.num_bytes() <= rom_end) {
+      return make_call(
+        size.stype_name(), make_const(size, rom.read_signed(size, *addr)));
+    }
+    return copy;
+  }
+
+  std::optional<slong_t> cast_value() const
+  {
+    if (!is_fn() || args.size() != 1 || !args.at(0).is_constant()) {
+      return std::nullopt;
+    }
+    auto size = size_of_stype(fn_name.value());
+    if (!size.has_value()) { return std::nullopt; }
+    return SizedValue::make(*size, args.at(0).constant->value).value;
+  }
+
+  // The value of the expression when it's known at recompile time. Constants
+  // are emitted as unsigned literals and casts are signed, which is how they
+  // are extended here.
+  std::optional<slong_t> known_value() const
+  {
+    if (is_constant()) {
+      switch (constant->size) {
+      case SizeKind::Byte:
+        return ubyte_t(constant->value);
+      case SizeKind::Word:
+        return uword_t(constant->value);
+      case SizeKind::Long:
+        return constant->value;
+      }
+    }
+    return cast_value();
+  }
+
+  // Replaces the reads of registers with a known value by that value
+  Expression substitute_regs(const KnownRegs& known) const
+  {
+    if (is_reg()) {
+      if (auto v = known.get(*reg); v) { return make_cast(reg->size, *v); }
+      return *this;
+    }
+    auto copy = *this;
+    for (int i = 0; i < std::ssize(copy.args); i++) {
+      if (kind == ExpressionKind::Assign && i == 0 && args.at(0).is_reg()) {
+        continue;
+      }
+      copy.args.at(i) = args.at(i).substitute_regs(known);
+    }
+    return copy;
+  }
+
+  // Size of a flag free inst_impls operation, like the W of ADD_NF<W>
+  std::optional<SizeKind> flag_free_size() const
+  {
+    auto name = fn_name.value();
+    auto pos = name.find("_NF<");
+    if (pos == std::string::npos || name.back() != '>') { return std::nullopt; }
+    return size_of_stype(name.substr(pos + 4, name.size() - pos - 5));
+  }
+
+  // Evaluates the flag free operations on known values, the ones updating the
+  // condition codes are left alone
+  std::optional<slong_t> eval_flag_free() const
+  {
+    auto size = flag_free_size();
+    if (!size.has_value()) { return std::nullopt; }
+    std::vector<slong_t> values;
+    for (const auto& a : args) {
+      auto v = a.known_value();
+      if (!v.has_value()) { return std::nullopt; }
+      values.push_back(*v);
+    }
+    auto op = fn_name->substr(0, fn_name->find("_NF<"));
+    int64_t v = SizedValue::make(*size, values.at(0)).value;
+    int64_t u = ulong_t(v) & size->mask();
+    if (values.size() == 1) {
+      if (op == "NOT") return SizedValue::make(*size, ~v).value;
+      if (op == "NEG") return SizedValue::make(*size, -v).value;
+      return std::nullopt;
+    }
+    if (values.size() != 2) { return std::nullopt; }
+    int64_t arg = values.at(1);
+    int64_t b = SizedValue::make(*size, values.at(1)).value;
+    std::optional<int64_t> ret;
+    if (op == "ADD") {
+      ret = v + b;
+    } else if (op == "SUB") {
+      ret = v - b;
+    } else if (op == "AND") {
+      ret = v & b;
+    } else if (op == "OR") {
+      ret = v | b;
+    } else if (op == "EOR") {
+      ret = v ^ b;
+    } else if (arg < 0 || arg >= 32) {
+      // Shifts this large are undefined in inst_impls, they're kept as is
+      return std::nullopt;
+    } else if (op == "LSL") {
+      ret = u << arg;
+    } else if (op == "LSR") {
+      ret = u >> arg;
+    } else if (op == "ASL") {
+      ret = v << arg;
+    } else if (op == "ASR") {
+      ret = v >> arg;
+    } else if (op == "BCLR") {
+      ret = v & ~(int64_t(1) << arg);
+    } else if (op == "BSET") {
+      ret = v | (int64_t(1) << arg);
+    } else if (op == "BCHG") {
+      ret = v ^ (int64_t(1) << arg);
+    }
+    if (!ret.has_value()) { return std::nullopt; }
+    return SizedValue::make(*size, slong_t(ulong_t(*ret))).value;
+  }
+
+  // Folds the arithmetic on known values, so addresses computed from
+  // constants become constants the bus accessors and rom folding can use
+  Expression fold_constants() const
+  {
+    auto copy = *this;
+    for (auto& a : copy.args) { a = a.fold_constants(); }
+    switch (kind) {
+    case ExpressionKind::Add:
+      return copy.simplify();
+    case ExpressionKind::Sub: {
+      auto a = copy.args.at(0).known_value();
+      auto b = copy.args.at(1).known_value();
+      if (a.has_value() && b.has_value()) {
+        return make_const(SizeKind::l(), slong_t(ulong_t(*a) - ulong_t(*b)));
+      }
+    } break;
+    case ExpressionKind::Ram: {
+      auto& addr = copy.args.at(0);
+      if (auto v = addr.cast_value(); v) {
+        addr = make_const(SizeKind::l(), *v);
+      }
+    } break;
+    case ExpressionKind::Call: {
+      if (auto v = copy.eval_flag_free(); v) {
+        return make_cast(copy.flag_free_size().value(), *v);
+      }
+    } break;
+    default:
+      break;
+    }
+    return copy;
+  }
+
+  void collect_regs(PromotedRegs& regs) const
+  {
+    if (is_reg()) { regs.use(reg->reg); }
+    if (kind == ExpressionKind::Assign && args.at(0).is_reg()) {
+      regs.write(args.at(0).reg->reg);
     }
+    for (const auto& a : args) { a.collect_regs(regs); }
   }
 
   bool is_zero() const
@@ -724,6 +1187,7 @@ struct Expression {
   bool is_add() const { return kind == ExpressionKind::Add; }
   bool is_sub() const { return kind == ExpressionKind::Sub; }
   bool is_reg() const { return kind == ExpressionKind::Reg; }
+  bool is_ram() const { return kind == ExpressionKind::Ram; }
   bool is_comment() const { return kind == ExpressionKind::Comment; }
   bool is_fn() const { return kind == ExpressionKind::Call; }
 
@@ -736,42 +1200,18 @@ struct Expression {
     return false;
   }
 
-  bool has_ucc() const
-  {
-    return has(
-      [](auto&& a) { return a.is_fn() && a.fn_name.value() == "UCC"; });
-  }
-
-  bool has_cc_updating_fn() const
-  {
-    constexpr const char* cc_update_fns[] = {
-      "ADD<L>",
-      "ADD<W>",
-      "AND<W>",
-      "ASL<L>",
-      "ASR<L>",
-      "CMP<L>",
-      "SUB<L>",
-      "SUB<W>",
-      "UCC",
-    };
-    return has([&cc_update_fns](auto&& a) {
-      if (!a.is_fn()) return false;
-      const auto& name = a.fn_name.value();
-      for (const auto& n : cc_update_fns) {
-        if (name == n) { return true; }
-      }
-      return false;
-    });
-  }
-
-  Expression remove_ucc() const
+  // The same expression without computing condition codes, for instructions
+  // whose flag results are never read
+  Expression without_flags() const
   {
-    if (is_fn() && fn_name.value() == "UCC") { return args.at(0); }
-    std::vector<Expression> exprs;
-    for (const auto& a : args) { exprs.push_back(a.remove_ucc()); }
+    if (is_fn() && fn_name.value() == "UCC") {
+      return args.at(0).without_flags();
+    }
     auto copy = *this;
-    copy.args = std::move(exprs);
+    if (is_fn()) {
+      if (auto name = flag_free_name(*fn_name); name) { copy.fn_name = name; }
+    }
+    for (auto& a : copy.args) { a = a.without_flags(); }
     return copy;
   }
 
@@ -806,17 +1246,6 @@ struct Expression {
         exprs.emplace_back(std::move(a));
       }
     }
-    Expression* last_non_comment = nullptr;
-    for (int i = 0; i < std::ssize(exprs); i++) {
-      auto&& a = exprs.at(i);
-      if (a.is_comment()) continue;
-      if (last_non_comment != nullptr) {
-        if (a.has_cc_updating_fn() && last_non_comment->has_ucc()) {
-          *last_non_comment = last_non_comment->remove_ucc();
-        }
-      }
-      last_non_comment = &a;
-    }
     return Expression::make_seq(std::move(exprs));
   }
 
@@ -830,6 +1259,8 @@ struct Expression {
         for (auto& a : sa.add_args()) {
           if (a.is_constant()) {
             constant_sum = constant_sum + *a.constant;
+          } else if (auto v = a.cast_value(); v) {
+            constant_sum = constant_sum + SizedValue::l(*v);
           } else {
             new_args.emplace_back(std::move(a));
           }
@@ -851,8 +1282,11 @@ struct Expression {
       return Expression::make_assign(
         args.at(0).simplify(), args.at(1).simplify());
     } break;
-    case ExpressionKind::Call: {
-      return Expression::make_call(fn_name.value(), simplied_args());
+    case ExpressionKind::Call:
+    case ExpressionKind::Loop: {
+      auto copy = *this;
+      copy.args = simplied_args();
+      return copy;
     } break;
     case ExpressionKind::Goto:
       return make_goto(args.at(0).simplify());
@@ -873,6 +1307,67 @@ struct Expression {
   }
 };
 
+std::vector<Expression> write_back_regs(const PromotedRegs& regs)
+{
+  std::vector<Expression> exprs;
+  for (int i = 0; i < PromotedRegs::NumRegs; i++) {
+    if (!regs.written.at(i)) continue;
+    auto reg = PromotedRegs::reg(i);
+    exprs.push_back(Expression::make_assign(
+      Expression::make_id(reg_name(reg)),
+      Expression::make_id(local_reg_name(reg))));
+  }
+  return exprs;
+}
+
+std::vector<Expression> reload_regs(const PromotedRegs& regs)
+{
+  std::vector<Expression> exprs;
+  for (int i = 0; i < PromotedRegs::NumRegs; i++) {
+    if (!regs.used.at(i)) continue;
+    auto reg = PromotedRegs::reg(i);
+    exprs.push_back(Expression::make_assign(
+      Expression::make_id(local_reg_name(reg)),
+      Expression::make_id(reg_name(reg))));
+  }
+  return exprs;
+}
+
+// Replaces each call out of the function by the statements returned by fn,
+// spliced into the enclosing sequence
+template <class F> Expression replace_calls(const Expression& expr, F&& fn)
+{
+  if (expr.calls_out) { return Expression::make_seq(fn(expr)); }
+  auto copy = expr;
+  if (expr.kind == ExpressionKind::Seq) {
+    copy.args.clear();
+    for (const auto& a : expr.args) {
+      if (a.calls_out) {
+        for (auto& e : fn(a)) { copy.args.push_back(std::move(e)); }
+      } else {
+        copy.args.push_back(replace_calls(a, fn));
+      }
+    }
+  } else {
+    for (auto& a : copy.args) { a = replace_calls(a, fn); }
+  }
+  return copy;
+}
+
+// Registers written by the function are stored to G before each call, and all
+// the registers it uses are loaded again after it
+Expression sync_around_calls(const Expression& expr, const PromotedRegs& regs)
+{
+  return replace_calls(expr, [&](const Expression& call) {
+    auto exprs = write_back_regs(regs);
+    exprs.push_back(call);
+    for (auto& e : reload_regs(regs)) { exprs.push_back(std::move(e)); }
+    return exprs;
+  });
+}
+
+std::string temporary_name(SizeKind size) { return F("tmp_$", size); }
+
 Expression am_to_expression_addr(const AddrMode& am)
 {
   switch (am.kind) {
@@ -973,22 +1468,130 @@ Expression call_fn_expr(const Function& fn)
   for (const auto& arg : fn.args) {
     args.push_back(Expression::make_reg(arg.size, arg.reg));
   }
-  return Expression::make_call(fn.call_name(), args);
+  return Expression::make_fn_call(fn.call_name(), args);
+}
+
+// Target of an indirect JMP or JSR. A constant address resolves to a single
+// function, a table base plus an index indexes a jump table directly and
+// anything else goes through JUMP_MAP. The address may be a register value
+// substituted by the constant propagation, which is a cast.
+Expression indirect_call_expr(const Expression& target)
+{
+  auto addr = target.simplify();
+  if (auto v = addr.cast_value(); v) {
+    addr = Expression::make_const(SizeKind::l(), *v);
+  }
+  if (auto c = addr.constant_address(); c.has_value()) {
+    if (auto it = jump_map.find(*c); it != jump_map.end()) {
+      return call_fn_expr(functions.at(it->second));
+    }
+  }
+  if (addr.is_add() && addr.args.at(1).is_constant()) {
+    auto c = addr.args.at(1).constant_address().value();
+    if (auto table = find_jump_table(c); table.has_value()) {
+      return Expression::make_fn_call(table->name(), {addr});
+    }
+  }
+  return Expression::make_fn_call("JUMP_MAP", {addr});
+}
+
+// The test of a Bcc or DBcc. Unless it was fused with the instruction setting
+// the flags, it reads the status register.
+Expression branch_condition(
+  const Instruction& inst, const std::optional<Expression>& fused, bool negate)
+{
+  auto cond = fused.value_or(Expression::make_call(
+    "G.sr.check_condition",
+    Expression::make_id(F("Condition::$", inst.cond->to_string()))));
+  if (negate) { cond.fn_name = F("!$", cond.fn_name.value()); }
+  return cond;
+}
+
+// Whether the address computed for am depends on reg
+bool am_uses_reg(const AddrMode& am, const RegisterId& reg)
+{
+  switch (am.kind) {
+  case AddrModeKind::AReg:
+  case AddrModeKind::PostInc:
+  case AddrModeKind::PreDec:
+  case AddrModeKind::ALongDisp:
+    return am.reg == reg;
+  case AddrModeKind::AXByteDisp:
+    return am.reg == reg || am.reg2 == reg;
+  default:
+    return false;
+  }
+}
+
+// MOVEM as a single block access on the bus. Lists containing the address
+// register are left to the per register form, the order of its update
+// matters there.
+std::optional<Expression> movem_block_expr(const Instruction& inst)
+{
+  auto size = inst.size.value();
+  auto list = inst.register_list.value();
+  bool load = inst.src.has_value();
+  auto am = load ? inst.src.value() : inst.dst.value();
+  std::vector<RegisterId> regs;
+  for (int i = 0; i < 16; i++) {
+    if (!list.contains(i)) continue;
+    auto reg = list.reg(i);
+    if (am_uses_reg(am, reg)) { return std::nullopt; }
+    regs.push_back(reg);
+  }
+
+  auto bytes = Expression::make_const(
+    SizeKind::l(), std::ssize(regs) * size.num_bytes());
+  auto areg = Expression::make_reg(SizeKind::l(), am.reg);
+  std::vector<Expression> exprs;
+  if (am.kind == AddrModeKind::PreDec) {
+    // The first register in the list is stored at the highest address
+    exprs.push_back(
+      Expression::make_assign(areg, Expression::make_sub(areg, bytes)));
+    std::reverse(regs.begin(), regs.end());
+  }
+  auto addr = am_to_expression_addr(am);
+  if (load) {
+    auto block = Expression::make_id("tmp_regs");
+    exprs.push_back(Expression::make_call(
+      F("G.io->read_block<$>", size.stype_name()),
+      addr,
+      block,
+      Expression::make_const(SizeKind::l(), std::ssize(regs))));
+    for (int i = 0; i < std::ssize(regs); i++) {
+      exprs.push_back(Expression::make_assign(
+        Expression::make_reg(SizeKind::l(), regs[i]),
+        Expression::make_id(F("tmp_regs[$]", i))));
+    }
+  } else {
+    std::vector<Expression> args{addr};
+    for (const auto& reg : regs) {
+      args.push_back(Expression::make_reg(size, reg));
+    }
+    exprs.push_back(Expression::make_call(
+      F("G.io->write_regs<$>", size.stype_name()), std::move(args)));
+  }
+  if (am.kind == AddrModeKind::PostInc) {
+    exprs.push_back(
+      Expression::make_assign(areg, Expression::make_add(areg, bytes)));
+  }
+  return Expression::make_seq(exprs);
 }
 
 Expression instruction_to_expression_impl(
-  const Instruction& inst, const Function& fn)
+  const Instruction& inst,
+  const Function& fn,
+  const std::optional<Expression>& fused_condition)
 {
-  auto get_jump_fn = [&inst]() -> std::optional<Function> {
+  auto get_jump_fn = [&inst]() -> const Function* {
     if (auto addr = inst.jump_addr(); addr) { return find_function(*addr); }
-    return std::nullopt;
+    return nullptr;
   };
   auto make_call = [&]() {
     if (auto jfn = get_jump_fn(); jfn && fn.start != jfn->start) {
       return call_fn_expr(*jfn);
     } else {
-      return Expression::make_call(
-        "JUMP_MAP", am_to_expression_addr(inst.src.value()));
+      return indirect_call_expr(am_to_expression_addr(inst.src.value()));
     }
   };
   auto make_goto = [&]() {
@@ -1018,10 +1621,7 @@ Expression instruction_to_expression_impl(
       return gt;
     } else {
       return Expression::make_if(
-        Expression::make_call(
-          "G.sr.check_condition",
-          Expression::make_id(F("Condition::$", inst.cond->to_string()))),
-        gt);
+        branch_condition(inst, fused_condition, false), gt);
     }
   } break;
   case InstEnum::DBcc: {
@@ -1038,10 +1638,7 @@ Expression instruction_to_expression_impl(
       return block;
     } else {
       return Expression::make_if(
-        Expression::make_call(
-          "!G.sr.check_condition",
-          Expression::make_id(F("Condition::$", inst.cond->to_string()))),
-        block);
+        branch_condition(inst, fused_condition, true), block);
     }
   } break;
   case InstEnum::LEA: {
@@ -1063,9 +1660,11 @@ Expression instruction_to_expression_impl(
     auto size = inst.size.value();
     auto dst = inst.dst.value();
     auto src = inst.src.value();
-    return Expression::make_assign(
-      am_to_expression(size, dst),
-      Expression::make_call("UCC", am_to_expression(size, src)));
+    auto value = am_to_expression(size, src);
+    if (!inst.is_addr_reg_update()) {
+      value = Expression::make_call("UCC", value);
+    }
+    return Expression::make_assign(am_to_expression(size, dst), value);
   } break;
   case InstEnum::DIVU:
   case InstEnum::DIVS: {
@@ -1115,7 +1714,7 @@ Expression instruction_to_expression_impl(
   } break;
   case InstEnum::EXG: {
     auto size = inst.size.value();
-    auto tmp = Expression::make_id(F("tmp_$", size));
+    auto tmp = Expression::make_id(temporary_name(size));
     auto src = am_to_expression(size, inst.src.value());
     auto dst = am_to_expression(size, inst.dst.value());
     return Expression::make_seq(
@@ -1154,6 +1753,7 @@ Expression instruction_to_expression_impl(
     auto dst_size = dst.is_addr_reg() ? SizeKind::l() : inst.size.value();
     auto src = inst.src.value();
     auto fn_name = operation(dst_size, inst.name);
+    if (inst.is_addr_reg_update()) { fn_name = *flag_free_name(fn_name); }
 
     auto dst_expr = am_to_expression(dst_size, dst);
     auto src_expr = am_to_expression(src_size, src);
@@ -1161,6 +1761,7 @@ Expression instruction_to_expression_impl(
     return Expression::make_assign(dst_expr, value);
   } break;
   case InstEnum::MOVEM: {
+    if (auto block = movem_block_expr(inst); block) { return *block; }
     auto make = [&](SizeKind size, const AddrMode& am, int offset) {
       auto addr = am_to_expression_addr(am);
       if (!am.is_inc_or_dec()) {
@@ -1221,20 +1822,309 @@ Expression instruction_to_expression_impl(
   }
 }
 
-Expression instruction_to_expression(
-  const Instruction& inst, const Function& fn)
-{
-  std::vector<Expression> exprs;
+////////////////////////////////////////////////////////////////////////////////
+// Condition code liveness
+//
 
-  if (fn.labels.contains(inst.pc)) {
-    exprs.push_back(Expression::make_label(F("L{x}", inst.pc)));
-  }
+constexpr int FlagX = 1 << 0;
+constexpr int FlagN = 1 << 1;
+constexpr int FlagZ = 1 << 2;
+constexpr int FlagV = 1 << 3;
+constexpr int FlagC = 1 << 4;
 
-  exprs.push_back(
-    Expression::make_comment(F("{06x}: $", inst.pc, inst.to_string())));
+constexpr int FlagsNZVC = FlagN | FlagZ | FlagV | FlagC;
+constexpr int FlagsAll = FlagX | FlagsNZVC;
 
-  auto size = inst.size;
-  if (size && inst.name != InstEnum::MOVEM) {
+int condition_flags(Condition cond)
+{
+  switch (cond) {
+  case Condition::True:
+  case Condition::False:
+    return 0;
+  case Condition::NE:
+  case Condition::EQ:
+    return FlagZ;
+  case Condition::CC:
+  case Condition::CS:
+    return FlagC;
+  case Condition::VC:
+  case Condition::VS:
+    return FlagV;
+  case Condition::PL:
+  case Condition::MI:
+    return FlagN;
+  case Condition::HI:
+  case Condition::LS:
+    return FlagC | FlagZ;
+  case Condition::GE:
+  case Condition::LT:
+    return FlagN | FlagV;
+  case Condition::GT:
+  case Condition::LE:
+    return FlagN | FlagV | FlagZ;
+  }
+}
+
+// Flags an instruction reads and flags it sets, following the 68k. The flags
+// inst_impls leaves invalid, like the N, V and C of ADD, count as set since
+// nothing can read them afterwards.
+struct CcEffect {
+  int uses = 0;
+  int defs = 0;
+  // Flags that are only set sometimes, they don't kill earlier values but
+  // still have to be computed when live
+  int may_defs = 0;
+};
+
+CcEffect cc_effect(const Instruction& inst)
+{
+  if (inst.is_addr_reg_update()) { return {}; }
+  switch (inst.name) {
+  case InstEnum::MOVE:
+  case InstEnum::MOVEQ:
+  case InstEnum::CLR:
+  case InstEnum::TST:
+  case InstEnum::CMP:
+  case InstEnum::CMPA:
+  case InstEnum::CMPI:
+  case InstEnum::AND:
+  case InstEnum::ANDI:
+  case InstEnum::OR:
+  case InstEnum::ORI:
+  case InstEnum::EOR:
+  case InstEnum::EORI:
+  case InstEnum::NOT:
+  case InstEnum::EXT:
+  case InstEnum::SWAP:
+  case InstEnum::MULU:
+  case InstEnum::MULS:
+  case InstEnum::DIVU:
+  case InstEnum::DIVS:
+  case InstEnum::ROR:
+  case InstEnum::ROL:
+    return {.defs = FlagsNZVC};
+  case InstEnum::ASR:
+  case InstEnum::ASL:
+  case InstEnum::LSR:
+  case InstEnum::LSL:
+    // X is left alone when shifting by zero
+    return {.defs = FlagsNZVC, .may_defs = FlagX};
+  case InstEnum::ADDQ:
+  case InstEnum::SUBQ:
+  case InstEnum::ADD:
+  case InstEnum::ADDI:
+  case InstEnum::SUB:
+  case InstEnum::SUBI:
+  case InstEnum::NEG:
+    return {.defs = FlagsAll};
+  case InstEnum::BTST:
+  case InstEnum::BCLR:
+  case InstEnum::BSET:
+  case InstEnum::BCHG:
+    return {.defs = FlagZ};
+  case InstEnum::ABCD:
+    return {.uses = FlagX | FlagZ, .defs = FlagX | FlagC};
+  case InstEnum::MOVE_to_SR:
+    return {.defs = FlagsAll};
+  case InstEnum::MOVE_from_SR:
+    return {.uses = FlagsAll};
+  case InstEnum::ANDI_to_SR:
+  case InstEnum::ORI_to_SR:
+    return {.uses = FlagsAll, .defs = FlagsAll};
+  case InstEnum::Bcc:
+  case InstEnum::DBcc:
+    return {.uses = condition_flags(inst.cond.value())};
+  case InstEnum::BSR:
+  case InstEnum::JSR:
+    // The callee may look at the flags it was called with
+    return {.uses = FlagsAll};
+  default:
+    return {};
+  }
+}
+
+// Backward liveness of the condition codes over the function's control flow
+// graph. Returns the flags live after each instruction of the function.
+// Leaving the function, either by returning or by jumping somewhere else,
+// makes all the flags live.
+std::vector<int> cc_live_out(const Function& fn)
+{
+  const auto& insts = fn.insts;
+  const int num_insts = std::ssize(insts);
+
+  std::map<ulong_t, int> index;
+  for (int i = 0; i < num_insts; i++) { index.emplace(insts[i].pc, i); }
+
+  constexpr int Exit = -1;
+  auto find_inst = [&](ulong_t pc) {
+    auto it = index.find(pc);
+    return it == index.end() ? Exit : it->second;
+  };
+
+  std::vector<std::vector<int>> successors(num_insts);
+  for (int i = 0; i < num_insts; i++) {
+    const auto& inst = insts[i];
+    auto& succ = successors[i];
+    if (!inst.is_unconditional_jump()) {
+      succ.push_back(find_inst(inst.pc + inst.bytes));
+    }
+    switch (inst.name) {
+    case InstEnum::Bcc:
+    case InstEnum::DBcc:
+    case InstEnum::JMP: {
+      auto addr = inst.jump_addr();
+      if (!addr.has_value() || (*addr != fn.start && find_function(*addr))) {
+        // Indirect jumps and jumps into other functions leave this one
+        succ.push_back(Exit);
+      } else {
+        succ.push_back(find_inst(*addr));
+      }
+    } break;
+    case InstEnum::RTS:
+    case InstEnum::RTE:
+      succ.push_back(Exit);
+      break;
+    default:
+      break;
+    }
+  }
+
+  std::vector<int> live_in(num_insts, 0);
+  std::vector<int> live_out(num_insts, 0);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = num_insts - 1; i >= 0; i--) {
+      int out = 0;
+      for (int s : successors[i]) { out |= s == Exit ? FlagsAll : live_in[s]; }
+      auto effect = cc_effect(insts[i]);
+      int in = effect.uses | (out & ~effect.defs);
+      if (in != live_in[i] || out != live_out[i]) {
+        live_in[i] = in;
+        live_out[i] = out;
+        changed = true;
+      }
+    }
+  }
+  return live_out;
+}
+
+bool is_cc_dead(const Instruction& inst, int live_out)
+{
+  auto effect = cc_effect(inst);
+  return ((effect.defs | effect.may_defs) & live_out) == 0;
+}
+
+// What the condition code analysis found out about an instruction
+struct CcInfo {
+  // None of the flags the instruction sets are read
+  bool dead = false;
+
+  // The instruction only sets flags for the branch right after it, which
+  // tests its operands directly instead
+  bool fused = false;
+
+  // For a branch fused with the instruction before it, the test replacing the
+  // status register lookup
+  std::optional<Expression> condition;
+};
+
+// A TST or CMP followed by a branch on its flags can be turned into a plain
+// comparison of the operands. Returns the comparison when possible.
+std::optional<Expression> fuse_cc_test(
+  const Instruction& test,
+  const Instruction& branch,
+  const Function& fn,
+  int branch_live_out)
+{
+  if (branch.name != InstEnum::Bcc && branch.name != InstEnum::DBcc) {
+    return std::nullopt;
+  }
+  if (fn.labels.contains(branch.pc) || branch.pc != test.pc + test.bytes) {
+    // Other paths reach the branch with different flags
+    return std::nullopt;
+  }
+  auto cond = branch.cond.value();
+  switch (cond) {
+  case Condition::True:
+  case Condition::False:
+  case Condition::VC:
+  case Condition::VS:
+    return std::nullopt;
+  default:
+    break;
+  }
+
+  auto size = test.size.value();
+  const char* fn_name = nullptr;
+  std::vector<AddrMode> operands;
+  switch (test.name) {
+  case InstEnum::CMP:
+  case InstEnum::CMPA:
+  case InstEnum::CMPI:
+    fn_name = "CMP_CC";
+    operands = {test.dst.value(), test.src.value()};
+    break;
+  case InstEnum::TST:
+    fn_name = "TST_CC";
+    operands = {test.src.value()};
+    break;
+  default:
+    return std::nullopt;
+  }
+
+  // The test may still have to update the flags, then the operands are
+  // evaluated twice, which is only fine if that has no side effects
+  bool flags_live = !is_cc_dead(test, branch_live_out);
+  std::vector<Expression> args;
+  for (const auto& am : operands) {
+    if (am.is_inc_or_dec()) { return std::nullopt; }
+    auto arg = am_to_expression(size, am);
+    if (flags_live && arg.has([](auto&& e) { return e.is_ram(); })) {
+      return std::nullopt;
+    }
+    args.push_back(std::move(arg));
+  }
+  return Expression::make_call(
+    F("$<Condition::$, $>", fn_name, cond.to_string(), size.stype_name()),
+    std::move(args));
+}
+
+// Instructions that don't do anything other than updating the condition codes
+bool only_updates_cc(const Instruction& inst)
+{
+  switch (inst.name) {
+  case InstEnum::TST:
+  case InstEnum::CMP:
+  case InstEnum::CMPA:
+  case InstEnum::CMPI:
+  case InstEnum::BTST:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The label of the instruction, if something jumps to it, and a comment with
+// its disassembly
+void add_header(
+  std::vector<Expression>& exprs, const Instruction& inst, const Function& fn)
+{
+  if (fn.labels.contains(inst.pc)) {
+    exprs.push_back(Expression::make_label(F("L{x}", inst.pc)));
+  }
+  exprs.push_back(
+    Expression::make_comment(F("{06x}: $", inst.pc, inst.to_string())));
+}
+
+Expression instruction_to_expression(
+  const Instruction& inst, const Function& fn, const CcInfo& cc)
+{
+  std::vector<Expression> exprs;
+  add_header(exprs, inst, fn);
+
+  auto size = inst.size;
+  if (size && inst.name != InstEnum::MOVEM) {
     auto add_pre = [&](auto&& am) {
       if (am) {
         if (auto p = am_pre_expr(size.value(), *am); p) { exprs.push_back(*p); }
@@ -1243,7 +2133,22 @@ Expression instruction_to_expression(
     add_pre(inst.src);
     add_pre(inst.dst);
   }
-  exprs.push_back(instruction_to_expression_impl(inst, fn));
+  auto impl = instruction_to_expression_impl(inst, fn, cc.condition);
+  if (cc.fused) {
+    // The branch does the comparison, the test only stays when its flags are
+    // read after the branch
+    if (cc.dead) { impl = Expression::make_seq(); }
+  } else if (cc.dead) {
+    // Memory reads are kept even when nothing else is, device ports may have
+    // side effects
+    auto reads_memory = impl.has([](auto&& e) { return e.is_ram(); });
+    if (only_updates_cc(inst) && !reads_memory) {
+      impl = Expression::make_seq();
+    } else {
+      impl = impl.without_flags();
+    }
+  }
+  exprs.push_back(std::move(impl));
   if (size && inst.name != InstEnum::MOVEM) {
     auto add_post = [&](auto&& am) {
       if (am) {
@@ -1263,22 +2168,734 @@ Expression instruction_to_expression(
   }
 }
 
-void print_one_fn(Code& code, const Function& fn)
+////////////////////////////////////////////////////////////////////////////////
+// Constant propagation
+//
+
+bool is_jump_dispatch(const Expression& expr)
+{
+  if (!expr.is_fn() || !expr.calls_out) { return false; }
+  const auto& name = expr.fn_name.value();
+  return name == "JUMP_MAP" || name.starts_with("JUMP_TABLE_");
+}
+
+// Forwards the register values set from constants, like the base loaded by a
+// LEA, to the statements that follow. Only straight line code is tracked,
+// everything is forgotten at labels and after calls.
+Expression propagate_constants(const Expression& stmt, KnownRegs& known)
 {
+  switch (stmt.kind) {
+  case ExpressionKind::Label: {
+    known.clear();
+    return stmt;
+  } break;
+  case ExpressionKind::Seq: {
+    auto copy = stmt;
+    for (auto& a : copy.args) { a = propagate_constants(a, known); }
+    return copy;
+  } break;
+  case ExpressionKind::If: {
+    auto cond = stmt.args.at(0).substitute_regs(known).fold_constants();
+    auto taken = known;
+    auto body = propagate_constants(stmt.args.at(1), taken);
+    PromotedRegs regs;
+    body.collect_regs(regs);
+    known.forget(regs);
+    if (body.has([](auto&& e) { return e.calls_out; })) { known.clear(); }
+    return Expression::make_if(std::move(cond), std::move(body));
+  } break;
+  case ExpressionKind::Loop: {
+    // Each iteration starts with what the previous one left in the registers
+    auto copy = stmt;
+    copy.args.at(0) = stmt.args.at(0).substitute_regs(known).fold_constants();
+    known.clear();
+    copy.args.at(1) = propagate_constants(stmt.args.at(1), known);
+    known.clear();
+    return copy;
+  } break;
+  case ExpressionKind::Assign: {
+    auto dst = stmt.args.at(0);
+    auto rhs = stmt.args.at(1).substitute_regs(known).fold_constants();
+    if (!dst.is_reg()) {
+      dst = dst.substitute_regs(known).fold_constants();
+      return Expression::make_assign(std::move(dst), std::move(rhs));
+    }
+    auto size = dst.reg->size;
+    auto value = rhs.known_value();
+    if (value && !(rhs.is_constant() && rhs.constant->size == size)) {
+      rhs = Expression::make_cast(size, *value);
+    }
+    known.set(*dst.reg, value);
+    return Expression::make_assign(std::move(dst), std::move(rhs));
+  } break;
+  default: {
+    auto out = stmt.substitute_regs(known).fold_constants();
+    if (is_jump_dispatch(out)) { out = indirect_call_expr(out.args.at(0)); }
+    if (out.has([](auto&& e) { return e.calls_out; })) { known.clear(); }
+    return out;
+  } break;
+  }
+}
+
+// A DBRA loop over a single MOVE or CLR going through post incremented
+// pointers, like MOVE.L (A0)+,(A1)+, lowered to one range operation on the
+// bus. The other side of the move can be a value or a fixed port address
+// like the VDP data port. Only done when the flags the move sets are not read
+// after the loop.
+std::optional<Expression> block_loop_expr(
+  const Instruction& move,
+  const Instruction& dbra,
+  const Function& fn,
+  int live_after)
+{
+  if (
+    dbra.name != InstEnum::DBcc || dbra.cond != Condition::False ||
+    dbra.jump_addr() != move.pc || fn.labels.contains(dbra.pc) ||
+    (live_after & FlagsNZVC) != 0) {
+    return std::nullopt;
+  }
+  if (move.name != InstEnum::MOVE && move.name != InstEnum::CLR) {
+    return std::nullopt;
+  }
+  auto size = move.size.value();
+  auto counter = dbra.dst.value().reg;
+  auto dst = move.dst.value();
+  auto src =
+    move.name == InstEnum::CLR ? AddrMode::make_imm(size, 0) : move.src.value();
+
+  auto is_stream = [](const AddrMode& am) {
+    return am.kind == AddrModeKind::PostInc && am.reg != RegisterId::addr(7);
+  };
+  auto is_port = [](const AddrMode& am) {
+    return am.kind == AddrModeKind::AReg ||
+           am.kind == AddrModeKind::ImmAddrWord ||
+           am.kind == AddrModeKind::ImmAddrLong;
+  };
+  // The loop steps the counter and the stream pointers, a value read from one
+  // of them would change on every iteration
+  auto is_stepped = [&](const RegisterId& reg) {
+    return reg == counter || (is_stream(dst) && reg == dst.reg) ||
+           (is_stream(src) && reg == src.reg);
+  };
+  auto is_value = [&](const AddrMode& am) {
+    if (am.kind == AddrModeKind::Reg) { return !is_stepped(am.reg); }
+    return am.const_opt().has_value();
+  };
+  if (is_stream(src) && is_stream(dst) && src.reg == dst.reg) {
+    return std::nullopt;
+  }
+  if (is_stream(src) && dst.kind == AddrModeKind::AReg && src.reg == dst.reg) {
+    return std::nullopt;
+  }
+
+  auto op = [&]() -> std::optional<std::string> {
+    if (is_stream(dst)) {
+      if (is_stream(src)) return "copy";
+      if (is_value(src)) return "fill";
+    } else if (is_port(dst)) {
+      if (is_stream(src)) return "write_port";
+      if (is_value(src)) return "fill_port";
+    }
+    return std::nullopt;
+  }();
+  if (!op.has_value()) { return std::nullopt; }
+
+  auto count_reg = Expression::make_reg(SizeKind::w(), counter);
+  auto stype = size.stype_name();
+  auto source =
+    is_stream(src) ? am_to_expression_addr(src) : am_to_expression(size, src);
   std::vector<Expression> exprs;
-  for (auto& inst : fn.insts) {
-    exprs.push_back(instruction_to_expression(inst, fn));
+  add_header(exprs, move, fn);
+  exprs.push_back(Expression::make_call(
+    F("G.io->$<$>", *op, stype),
+    am_to_expression_addr(dst),
+    source,
+    Expression::make_call("LOOP_COUNT", count_reg)));
+  for (const auto& am : {src, dst}) {
+    if (!is_stream(am)) continue;
+    auto reg = Expression::make_reg(SizeKind::l(), am.reg);
+    auto bytes = Expression::make_call(F("LOOP_BYTES<$>", stype), count_reg);
+    exprs.push_back(
+      Expression::make_assign(reg, Expression::make_add(reg, bytes)));
+  }
+  add_header(exprs, dbra, fn);
+  exprs.push_back(Expression::make_assign(
+    count_reg, Expression::make_cast(SizeKind::w(), -1)));
+  return Expression::make_seq(exprs);
+}
+
+// Whether the instructions from head to the DBcc at dbcc, which jumps back to
+// head, can be emitted as a counted for loop. The range must only be entered
+// from the top, must not call out and must not change the counter other than
+// through the DBcc.
+bool is_counted_loop(
+  const Function& fn, const std::vector<Expression>& exprs, int head, int dbcc)
+{
+  const auto& insts = fn.insts;
+  const auto& tail = insts[dbcc];
+  if (
+    head >= dbcc || tail.name != InstEnum::DBcc ||
+    tail.jump_addr() != insts[head].pc) {
+    return false;
+  }
+  std::set<ulong_t> inner_pcs;
+  for (int i = head + 1; i <= dbcc; i++) { inner_pcs.insert(insts[i].pc); }
+  if (inner_pcs.contains(fn.start)) { return false; }
+  for (int i = 0; i < std::ssize(insts); i++) {
+    auto addr = insts[i].jump_addr();
+    if (!addr.has_value()) continue;
+    bool inside = i >= head && i <= dbcc;
+    if (!inside && inner_pcs.contains(*addr)) { return false; }
+    // Jumping back to the head from the body would restart the count
+    if (inside && i != dbcc && *addr == insts[head].pc) { return false; }
+  }
+  PromotedRegs regs;
+  for (int i = head; i < dbcc; i++) {
+    if (exprs[i].has([](auto&& e) { return e.calls_out; })) { return false; }
+    exprs[i].collect_regs(regs);
+  }
+  auto counter = PromotedRegs::index(tail.dst.value().reg).value();
+  return !regs.written.at(counter);
+}
+
+// The end of a counted loop body. The counter is still decremented on every
+// iteration, the body and the code after a jump out of the loop may read it.
+Expression loop_tail_expr(
+  const Instruction& dbcc, const Function& fn, const CcInfo& cc)
+{
+  std::vector<Expression> exprs;
+  add_header(exprs, dbcc, fn);
+  if (dbcc.cond != Condition::False) {
+    exprs.push_back(Expression::make_if(
+      branch_condition(dbcc, cc.condition, false),
+      Expression::make_id("break")));
+  }
+  auto reg = am_to_expression(SizeKind::w(), dbcc.dst.value());
+  exprs.push_back(Expression::make_assign(
+    reg, Expression::make_sub(reg, Expression::make_const(SizeKind::w(), 1))));
+  return Expression::make_seq(exprs);
+}
+
+// Emits the instructions in [begin, end), turning the DBcc loops found in the
+// range into counted for loops. Nested loops are handled by the recursion on
+// the body.
+std::vector<Expression> structure_loops(
+  const Function& fn,
+  const std::vector<Expression>& exprs,
+  const std::vector<bool>& lowered,
+  const std::vector<CcInfo>& cc,
+  int begin,
+  int end)
+{
+  const auto& insts = fn.insts;
+  std::vector<Expression> out;
+  for (int i = begin; i < end; i++) {
+    int dbcc = end - 1;
+    for (; dbcc > i; dbcc--) {
+      if (!lowered[dbcc] && is_counted_loop(fn, exprs, i, dbcc)) break;
+    }
+    if (dbcc == i) {
+      out.push_back(exprs[i]);
+      continue;
+    }
+    // The head label stays out of the loop, it's where the count is set up
+    auto head = exprs[i];
+    out.push_back(head.args.at(0));
+    head.args.erase(head.args.begin());
+    auto body = structure_loops(fn, exprs, lowered, cc, i + 1, dbcc);
+    body.insert(body.begin(), std::move(head));
+    body.push_back(loop_tail_expr(insts[dbcc], fn, cc[dbcc]));
+    auto counter = Expression::make_reg(SizeKind::w(), insts[dbcc].dst->reg);
+    out.push_back(Expression::make_loop(
+      F("n{x}", insts[i].pc),
+      Expression::make_call("LOOP_COUNT", counter),
+      Expression::make_seq(std::move(body))));
+    i = dbcc;
+  }
+  return out;
+}
+
+Expression function_body(const Function& fn, Memory& rom)
+{
+  const auto& insts = fn.insts;
+  auto live_out = cc_live_out(fn);
+  std::vector<CcInfo> cc(insts.size());
+  for (int i = 0; i < std::ssize(insts); i++) {
+    cc[i].dead = is_cc_dead(insts[i], live_out[i]);
+  }
+  for (int i = 0; i + 1 < std::ssize(insts); i++) {
+    auto cond = fuse_cc_test(insts[i], insts[i + 1], fn, live_out[i + 1]);
+    if (!cond.has_value()) continue;
+    cc[i].fused = true;
+    cc[i].dead = is_cc_dead(insts[i], live_out[i + 1]);
+    cc[i + 1].condition = std::move(cond);
+  }
+
+  // A block loop takes the place of both of its instructions, the DBcc is left
+  // empty and marked as lowered
+  std::vector<Expression> exprs(insts.size(), Expression::make_seq());
+  std::vector<bool> lowered(insts.size(), false);
+  for (int i = 0; i < std::ssize(insts); i++) {
+    if (i + 1 < std::ssize(insts)) {
+      auto loop = block_loop_expr(insts[i], insts[i + 1], fn, live_out[i + 1]);
+      if (loop.has_value()) {
+        exprs[i] = std::move(*loop);
+        lowered[i + 1] = true;
+        i++;
+        continue;
+      }
+    }
+    exprs[i] = instruction_to_expression(insts[i], fn, cc[i]);
+  }
+  auto body = Expression::make_seq(
+                structure_loops(fn, exprs, lowered, cc, 0, std::ssize(insts)))
+                .simplify()
+                .fold_rom_reads(rom);
+  KnownRegs known;
+  return propagate_constants(body, known).simplify().fold_rom_reads(rom);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Inlining
+//
+
+struct Inliner {
+ public:
+  Inliner(int budget) : _budget(budget) {}
+
+  // Small leaf functions are inlined into their callers. Since they don't call
+  // anything, there's no recursion to worry about.
+  void add_candidate(const Function& fn, const Expression& body)
+  {
+    if (fn.skip_inlining || std::ssize(fn.insts) > _budget) { return; }
+    if (body.has([](auto&& e) { return e.calls_out; })) { return; }
+    auto name = fn.call_name();
+    _candidates.emplace(name, Candidate{.fn = fn, .body = body});
+    _inlined_sites.try_emplace(name, 0);
+  }
+
+  // Can be called from several threads once all the candidates are added. The
+  // call sites are numbered per caller, so the output doesn't depend on the
+  // order the callers are processed.
+  Expression inline_calls(const Expression& body)
+  {
+    int next_site = 0;
+    return replace_calls(body, [&](const Expression& call) {
+      const auto& name = call.fn_name.value();
+      auto it = _candidates.find(name);
+      if (it == _candidates.end()) { return std::vector<Expression>{call}; }
+      _inlined_sites.at(name)++;
+      return _inlined_body(it->second.fn, it->second.body, next_site++);
+    });
+  }
+
+  void print_report() const
+  {
+    int sites = 0;
+    int fns = 0;
+    for (const auto& [_, count] : _inlined_sites) {
+      if (count == 0) continue;
+      sites += count;
+      fns++;
+    }
+    PE("Inlined $ call sites of $ functions, budget: $ instructions",
+      sites,
+      fns,
+      _budget);
+  }
+
+ private:
+  struct Candidate {
+    Function fn;
+    Expression body;
+  };
+
+  // Labels get a suffix unique to the call site, and returning becomes a jump
+  // to the end of the inlined code. The call and return are still logged
+  // under the callee's name, so the verbose trace is the same as without
+  // inlining.
+  static std::vector<Expression> _inlined_body(
+    const Function& fn, const Expression& body, int site)
+  {
+    auto suffix = F("_$", site);
+    auto exit_label = F("$_end$", fn.name(), suffix);
+    auto name = Expression::make_id(F("\"$\"", fn.name()));
+    std::vector<Expression> exprs;
+    exprs.push_back(Expression::make_comment(F("Inlined $", fn.name())));
+    exprs.push_back(Expression::make_call("_log_call", name));
+    if (fn.insts.front().pc != fn.start) {
+      auto entry = F("L{x}$", fn.start, suffix);
+      exprs.push_back(Expression::make_goto(Expression::make_id(entry)));
+    }
+    exprs.push_back(_rename_labels(body, suffix, exit_label));
+    exprs.push_back(Expression::make_label(exit_label));
+    exprs.push_back(Expression::make_call("_log_ret", name));
+    return exprs;
+  }
+
+  static Expression _rename_labels(
+    const Expression& expr,
+    const std::string& suffix,
+    const std::string& exit_label)
+  {
+    switch (expr.kind) {
+    case ExpressionKind::Return:
+      return Expression::make_goto(Expression::make_id(exit_label));
+    case ExpressionKind::Label:
+      return Expression::make_label(expr.label_name.value() + suffix);
+    case ExpressionKind::Goto:
+      return Expression::make_goto(
+        Expression::make_id(expr.args.at(0).id.value() + suffix));
+    default: {
+      auto copy = expr;
+      for (auto& a : copy.args) { a = _rename_labels(a, suffix, exit_label); }
+      return copy;
+    }
+    }
+  }
+
+  int _budget;
+  std::map<std::string, Candidate> _candidates;
+  std::map<std::string, std::atomic<int>> _inlined_sites;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipeline
+//
+
+// Runs fn(i) for every i in [0, count) on all the cores. The first exception
+// thrown is rethrown once all the threads are done.
+template <class F> void parallel_for(int count, F&& fn)
+{
+  std::atomic<int> next = 0;
+  std::exception_ptr error;
+  std::atomic_flag failed;
+  auto worker = [&]() {
+    for (int i = next++; i < count; i = next++) {
+      try {
+        fn(i);
+      } catch (...) {
+        if (!failed.test_and_set()) { error = std::current_exception(); }
+        next = count;
+      }
+    }
+  };
+  {
+    std::vector<std::jthread> threads;
+    int num_threads = std::max<int>(1, std::thread::hardware_concurrency());
+    for (int i = 1; i < num_threads; i++) { threads.emplace_back(worker); }
+    worker();
+  }
+  if (error) { std::rethrow_exception(error); }
+}
+
+// Prints how long each phase of the recompilation took
+struct PhaseTimer {
+ public:
+  PhaseTimer() : _start(bee::Time::now()) {}
+
+  void done(const char* phase)
+  {
+    auto now = bee::Time::now();
+    PE("$: $", phase, now - _start);
+    _start = now;
+  }
+
+ private:
+  bee::Time _start;
+};
+
+void print_one_fn(Code& code, const Function& fn, const Expression& body)
+{
+  // The registers live in locals for the whole function so the compiler can
+  // keep them in host registers across memory accesses
+  PromotedRegs regs;
+  body.collect_regs(regs);
+  for (int i = 0; i < PromotedRegs::NumRegs; i++) {
+    if (!regs.used.at(i)) continue;
+    auto reg = PromotedRegs::reg(i);
+    code.f(
+      "  $ $ = $;",
+      reg.is_addr() ? "AddrRegister" : "DataRegister",
+      local_reg_name(reg),
+      reg_name(reg));
+  }
+  for (auto size : {SizeKind::b(), SizeKind::w(), SizeKind::l()}) {
+    auto name = temporary_name(size);
+    if (body.has([&](auto&& e) { return e.id == name; })) {
+      code.f("  $ $;", size.utype_name(), name);
+    }
+  }
+  if (body.has([](auto&& e) { return e.id == "tmp_regs"; })) {
+    code.s("  L tmp_regs[16];");
+  }
+  code.s("");
+
+  if (fn.insts.begin()->pc != fn.start) { code.f("  goto L{x};", fn.start); }
+  code.f("  $", sync_around_calls(body, regs).to_cpp_code());
+  code.s("");
+  code.s("  end:");
+  for (auto& e : write_back_regs(regs)) { code.f("  $;", e.to_cpp_code()); }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+//
+
+// Manual functions can't be put in a handler array, they get a thunk
+std::string handler_name(const Function& fn)
+{
+  return fn.manual_name.has_value() ? F("J{x}", fn.start) : fn.name();
+}
+
+std::set<ulong_t> thunk_addrs()
+{
+  std::set<ulong_t> thunks;
+  for (const auto& table : jump_tables) {
+    for (ulong_t pc = table.base; pc <= table.end; pc += table.step) {
+      const auto& fn = functions.at(jump_map.at(pc));
+      if (fn.manual_name.has_value()) { thunks.insert(fn.start); }
+    }
+  }
+  return thunks;
+}
+
+// Functions are split in address order, so a shard mostly holds functions
+// calling each other, and by instruction count rather than by generated code
+// size, so the split doesn't move when the recompiler changes
+std::vector<std::vector<const Function*>> partition_functions(int num_shards)
+{
+  int total = 1;
+  for (const auto& [_, fn] : functions) {
+    if (!fn.manual_name.has_value()) { total += std::ssize(fn.insts); }
+  }
+  std::vector<std::vector<const Function*>> shards(num_shards);
+  int done = 0;
+  for (const auto& [_, fn] : functions) {
+    if (fn.manual_name.has_value()) continue;
+    int shard = std::min(done * num_shards / total, num_shards - 1);
+    shards.at(shard).push_back(&fn);
+    done += std::ssize(fn.insts);
+  }
+  return shards;
+}
+
+void print_pragmas(Code& code)
+{
+  code.f("#pragma clang diagnostic ignored \"-Wunused-label\"");
+  code.f("#pragma clang diagnostic ignored \"-Wunused-function\"");
+  code.f("#pragma clang diagnostic ignored \"-Wunused-variable\"");
+  code.f("");
+}
+
+// The class declares every generated function, so they can be defined in any
+// of the shards
+void print_impl_class(Code& code)
+{
+  code.s("template <bool Verbose>");
+  code.s("struct GeneratedImpl final : public GeneratedIntf {");
+  code.s("");
+  code.s("using Handler = void (GeneratedImpl::*)();");
+  code.s("");
+  code.s("template <size_t N>");
+  code.s("bool _dispatch(");
+  code.s("  const Handler (&table)[N],");
+  code.s("  ulong_t base,");
+  code.s("  ulong_t step,");
+  code.s("  ulong_t addr)");
+  code.s("{");
+  code.s("  ulong_t offset = addr - base;");
+  code.s("  if (offset % step != 0 || offset / step >= N) { return false; }");
+  code.s("  (this->*table[offset / step])();");
+  code.s("  return true;");
+  code.s("}");
+  code.s("");
+  code.s("void JUMP_MAP(ulong_t addr);");
+  for (const auto& table : jump_tables) {
+    code.f("void $(ulong_t addr);", table.name());
+  }
+  for (ulong_t addr : thunk_addrs()) { code.f("void J{x}();", addr); }
+  for (const auto& [_, fn] : functions) {
+    if (fn.manual_name.has_value()) continue;
+    code.f("void $();", fn.name());
+  }
+  code.s("");
+  code.s("GeneratedImpl(const ManualFunctions::ptr& m) : _m(m) {}");
+  code.s("void run() { _m->start(); }");
+  code.s("void jump_map(ulong_t addr) { JUMP_MAP(addr); }");
+  code.s("void vblank_int() { F5c88(); }");
+  code.s("void _log_call(const char* fn_name) const");
+  code.s("{");
+  code.s("  if constexpr (Verbose) P(\"Call $\", fn_name);");
+  code.s("}");
+  code.s("void _log_ret(const char* fn_name) const");
+  code.s("{");
+  code.s("  if constexpr (Verbose) P(\"Returned $\", fn_name);");
+  code.s("}");
+  code.s("ManualFunctions::ptr _m;");
+  code.s("");
+  for (const auto& table : jump_tables) {
+    code.f("static constexpr Handler $[] = {{", table.array_name());
+    for (ulong_t pc = table.base; pc <= table.end; pc += table.step) {
+      const auto& fn = functions.at(jump_map.at(pc));
+      code.f("  &GeneratedImpl::$,", handler_name(fn));
+    }
+    code.s("};");
+  }
+  code.s("");
+  code.s("};");
+  code.s("");
+}
+
+// The jump dispatch and the thunks, everything other than the functions
+// recompiled from the rom
+void print_dispatch(Code& code)
+{
+  code.s("template <bool Verbose>");
+  code.s("void GeneratedImpl<Verbose>::JUMP_MAP(ulong_t addr) {");
+  code.s("  _log_call(__func__);");
+  code.s("");
+  for (const auto& table : jump_tables) {
+    code.f(
+      "  if (_dispatch($, 0x{x}, $, addr)) {{",
+      table.array_name(),
+      table.base,
+      table.step);
+    code.s("    _log_ret(__func__);");
+    code.s("    return;");
+    code.s("  }");
+  }
+  code.s("  switch (addr) {");
+  for (auto&& [addr, fn_addr] : jump_map) {
+    if (auto table = find_jump_table(addr); table && table->contains(addr)) {
+      continue;
+    }
+    auto fn = functions.find(fn_addr)->second;
+    code.f("  case 0x{x}: $; break;", addr, fn.call_code());
+  }
+  code.s("  default: raise_error(\"No mapping for address: {x}\", "
+         "addr);");
+  code.s("  }");
+  code.s("  _log_ret(__func__);");
+  code.s("}");
+  code.s("");
+
+  for (const auto& table : jump_tables) {
+    code.s("template <bool Verbose>");
+    code.f("void GeneratedImpl<Verbose>::$(ulong_t addr) {{", table.name());
+    code.s("  _log_call(__func__);");
+    code.f(
+      "  if (!_dispatch($, 0x{x}, $, addr)) {{ JUMP_MAP(addr); }",
+      table.array_name(),
+      table.base,
+      table.step);
+    code.s("  _log_ret(__func__);");
+    code.s("}");
+    code.s("");
+  }
+  for (ulong_t addr : thunk_addrs()) {
+    code.s("template <bool Verbose>");
+    code.f(
+      "void GeneratedImpl<Verbose>::J{x}() {{ $; }",
+      addr,
+      functions.at(addr).call_code());
+  }
+  code.s("");
+}
+
+void print_create(Code& code)
+{
+  code.s("GeneratedIntf::ptr Generated::create(");
+  code.s("  bool verbose, const ManualFunctions::ptr& m)");
+  code.s("{");
+  code.s("  if (verbose) {");
+  code.s("    return std::make_shared<GeneratedImpl<true>>(m);");
+  code.s("  } else {");
+  code.s("    return std::make_shared<GeneratedImpl<false>>(m);");
+  code.s("  }");
+  code.s("}");
+  code.s("");
+}
+
+// The functions are printed in parallel, then appended in order
+void print_fns(
+  Code& code,
+  const std::vector<const Function*>& fns,
+  Inliner& inliner,
+  const std::map<ulong_t, Expression>& bodies)
+{
+  std::vector<Code> fn_codes(fns.size());
+  parallel_for(std::ssize(fns), [&](int i) {
+    const auto& fn = *fns[i];
+    auto& fn_code = fn_codes[i];
+    fn_code.s("template <bool Verbose>");
+    fn_code.f("void GeneratedImpl<Verbose>::$() {{", fn.name());
+    fn_code.s("  _log_call(__func__);");
+    fn_code.s("");
+    print_one_fn(fn_code, fn, inliner.inline_calls(bodies.at(fn.start)));
+    fn_code.s("  _log_ret(__func__);");
+    fn_code.s("}");
+    fn_code.s("");
+  });
+  for (auto& fn_code : fn_codes) { code.append(std::move(fn_code)); }
+}
+
+// The members defined in a shard are instantiated there, the other files only
+// see their declarations
+void print_instantiations(Code& code, const std::vector<std::string>& names)
+{
+  for (const auto& name : names) {
+    code.f("template void GeneratedImpl<false>::$();", name);
+    code.f("template void GeneratedImpl<true>::$();", name);
   }
-  auto icode = Expression::make_seq(exprs).simplify().to_cpp_code();
-  code.f("  $", icode);
+  code.s("");
+}
+
+std::string join_lines(const Code& code)
+{
+  std::string out;
+  for (const auto& line : code.lines()) {
+    out += line;
+    out += '\n';
+  }
+  return out;
+}
+
+// Files whose content didn't change are left untouched, so the build doesn't
+// compile them again
+bee::OrError<bool> write_if_changed(
+  const bee::FilePath& path, const std::string& content)
+{
+  auto old = bee::FileReader::read_file(path);
+  if (!old.is_error() && *old == content) { return false; }
+  bail_unit(bee::FileWriter::save_file(path, content));
+  return true;
 }
 
+// The instructions reachable from the entry points, disassembled once and
+// kept sorted by address
+struct InstDb {
+ public:
+  std::vector<Instruction> insts;
+
+  const Instruction& at(ulong_t pc) const
+  {
+    auto it = std::lower_bound(
+      insts.begin(), insts.end(), pc, [](const Instruction& inst, ulong_t pc) {
+        return inst.pc < pc;
+      });
+    if (it == insts.end() || it->pc != pc) {
+      raise_error("No instruction at {x}", pc);
+    }
+    return *it;
+  }
+};
+
 template <class T>
-bee::OrError<std::map<ulong_t, Instruction>> find_reachable_insts(
-  Disasm& d, const T& starting_pcs)
+bee::OrError<InstDb> find_reachable_insts(Disasm& d, const T& starting_pcs)
 {
-  std::map<ulong_t, Instruction> insts;
-  std::set<ulong_t> seen;
+  InstDb db;
+  std::unordered_set<ulong_t> seen;
   std::deque<ulong_t> queue;
 
   auto enqueue = [&](ulong_t pc) {
@@ -1299,22 +2916,23 @@ bee::OrError<std::map<ulong_t, Instruction>> find_reachable_insts(
   while (!queue.empty()) {
     ulong_t pc = dequeue();
     bail(inst, d.disasm_one(pc));
-    insts.emplace(inst.pc, inst);
     if (auto addr = inst.jump_addr(); addr) { enqueue(*addr); }
     if (!inst.is_unconditional_jump()) { enqueue(inst.pc + inst.bytes); }
+    db.insts.push_back(std::move(inst));
   }
-  return insts;
+  bee::sort(db.insts, [](auto&& i1, auto&& i2) { return i1.pc < i2.pc; });
+  return db;
 }
 
 bee::OrError<std::vector<Instruction>> find_function_insts(
-  const std::map<ulong_t, Instruction>& all_insts, ulong_t start_pc)
+  const InstDb& all_insts, ulong_t start_pc)
 {
   std::vector<Instruction> fn_insts;
-  std::set<ulong_t> seen;
+  std::unordered_set<ulong_t> seen;
   std::deque<ulong_t> queue;
 
   auto is_another_fn = [&](ulong_t pc) {
-    return (pc != start_pc && find_function(pc));
+    return (pc != start_pc && functions.contains(pc));
   };
 
   auto enqueue = [&](ulong_t pc) {
@@ -1356,12 +2974,48 @@ bee::OrError<std::vector<Instruction>> find_function_insts(
   return std::move(fn_insts);
 }
 
+// Every jump target in the function gets a label, so does the entry point
+// when it's not the first instruction
+void add_labels(Function& fn)
+{
+  if (fn.start != fn.insts.front().pc) { fn.labels.insert(fn.start); }
+  for (auto& inst : fn.insts) {
+    if (auto addr = inst.jump_addr(); addr) { fn.labels.insert(*addr); }
+  }
+}
+
+// From here on the functions are only read, which lets the bodies be built in
+// parallel
+std::map<ulong_t, Expression> build_bodies(Memory& rom, Inliner& inliner)
+{
+  std::vector<const Function*> generated_fns;
+  for (const auto& [_, fn] : functions) {
+    if (!fn.manual_name.has_value()) { generated_fns.push_back(&fn); }
+  }
+  std::vector<std::optional<Expression>> built(generated_fns.size());
+  parallel_for(std::ssize(generated_fns), [&](int i) {
+    built[i] = function_body(*generated_fns[i], rom);
+  });
+  std::map<ulong_t, Expression> bodies;
+  for (int i = 0; i < std::ssize(generated_fns); i++) {
+    inliner.add_candidate(*generated_fns[i], *built[i]);
+    bodies.emplace(generated_fns[i]->start, std::move(*built[i]));
+  }
+  return bodies;
+}
+
 } // namespace
 
-bee::OrError<> ToCpp::to_cpp(const std::string& rom_content)
+bee::OrError<> ToCpp::to_cpp(
+  const Rom::ptr& rom,
+  int inline_budget,
+  const std::optional<bee::FilePath>& output_dir,
+  int num_shards)
 {
-  auto rom = std::make_shared<Memory>(rom_content);
-  bail(d, Disasm::create(rom));
+  if (num_shards < 1) { return EF("Invalid number of shards: $", num_shards); }
+  PhaseTimer timer;
+  auto rom_memory = std::make_shared<Memory>(rom);
+  bail(d, Disasm::create(rom_memory));
 
   std::set<ulong_t> funcs = {
     0x00200, 0x00300, 0x00488, 0x0091a, 0x00928, 0x00958, 0x0095c, 0x00960,
@@ -1374,8 +3028,6 @@ bee::OrError<> ToCpp::to_cpp(const std::string& rom_content)
     0x04776, 0x0fa98, 0x05f82,
   };
 
-  std::map<ulong_t, ulong_t> fn_jump_map;
-
   const ulong_t ranges[][3] = {
     {0x0542, 0x05de, 4},
     {0x09ce, 0x0a36, 4},
@@ -1388,8 +3040,9 @@ bee::OrError<> ToCpp::to_cpp(const std::string& rom_content)
       bail(inst, d->disasm_one(pc));
       auto addr = inst.jump_addr().value();
       funcs.insert(addr);
-      fn_jump_map.emplace(pc, addr);
+      jump_map.emplace(pc, addr);
     }
+    jump_tables.push_back({.base = start, .end = end, .step = step});
   }
 
   auto extra_jump_fns = {
@@ -1419,12 +3072,13 @@ bee::OrError<> ToCpp::to_cpp(const std::string& rom_content)
   };
 
   for (ulong_t addr : extra_jump_fns) {
-    fn_jump_map.emplace(addr, addr);
+    jump_map.emplace(addr, addr);
     funcs.insert(addr);
   }
 
   bail(insts, find_reachable_insts(*d, funcs));
-  for (const auto& [_, inst] : insts) {
+  timer.done("Disassembly");
+  for (const auto& inst : insts.insts) {
     if (auto addr = inst.jump_addr(); addr && inst.is_fn_call()) {
       funcs.insert(*addr);
     }
@@ -1439,6 +3093,7 @@ bee::OrError<> ToCpp::to_cpp(const std::string& rom_content)
   auto set_manual = [&](ulong_t addr, const char* name, const auto&&... args) {
     auto& f = get_fn(addr);
     f.manual_name = name;
+    f.skip_inlining = true;
     f.args = {args...};
   };
 
@@ -1530,100 +3185,163 @@ bee::OrError<> ToCpp::to_cpp(const std::string& rom_content)
   for (auto&& [_, fn] : functions) {
     bail(ret, find_function_insts(insts, fn.start));
     fn.insts = std::move(ret);
-    if (fn.start != fn.insts.front().pc) { fn.labels.insert(fn.start); }
-    for (auto& inst : fn.insts) {
-      if (auto addr = inst.jump_addr(); addr) { fn.labels.insert(*addr); }
+    add_labels(fn);
+  }
+  timer.done("Function discovery");
+
+  Inliner inliner(inline_budget);
+  auto bodies = build_bodies(*rom_memory, inliner);
+  timer.done("Expressions");
+
+  if (!output_dir.has_value()) {
+    Code code;
+    print_pragmas(code);
+    code.f("#include \"generated.hpp\"");
+    code.f("");
+    code.f("#include \"inst_impls.hpp\"");
+    code.f("#include \"magic_constants.hpp\"");
+    code.f("#include \"manual_functions.hpp\"");
+    code.f("");
+    code.f("#include \"bee/print.hpp\"");
+    code.f("");
+    code.f("namespace heaven_ice {{");
+    code.f("namespace {{");
+    code.f("");
+    print_impl_class(code);
+    print_dispatch(code);
+    code.flush_to_stdout();
+    // The functions are generated in batches and printed as each one is done,
+    // so the whole output is never held in memory
+    constexpr int BatchSize = 64;
+    auto fns = partition_functions(1).at(0);
+    for (int i = 0; i < std::ssize(fns); i += BatchSize) {
+      std::vector<const Function*> batch(
+        fns.begin() + i,
+        fns.begin() + std::min<int>(i + BatchSize, std::ssize(fns)));
+      print_fns(code, batch, inliner, bodies);
+      code.flush_to_stdout();
     }
+    code.s("}");
+    code.s("");
+    print_create(code);
+    code.s("}");
+    code.flush_to_stdout();
+    timer.done("Code generation");
+    inliner.print_report();
+    return bee::ok();
+  }
+
+  // Sharded output, the class goes in a header shared by the shards. Each file
+  // is written as soon as it's generated.
+  int num_files = 0;
+  int written = 0;
+  auto write = [&](
+                 const std::string& name, const Code& code) -> bee::OrError<> {
+    auto path = *output_dir / bee::FilePath(name);
+    bail(changed, write_if_changed(path, join_lines(code)));
+    num_files++;
+    if (changed) { written++; }
+    return bee::ok();
+  };
+  {
+    Code code;
+    code.s("#pragma once");
+    code.s("");
+    code.s("#include \"generated_intf.hpp\"");
+    code.s("#include \"inst_impls.hpp\"");
+    code.s("#include \"magic_constants.hpp\"");
+    code.s("#include \"manual_functions.hpp\"");
+    code.s("");
+    code.s("#include \"bee/print.hpp\"");
+    code.s("");
+    code.f("namespace heaven_ice {{");
+    code.s("");
+    print_impl_class(code);
+    code.s("}");
+    bail_unit(write("generated_impl.hpp", code));
   }
-
-  Code code;
-  code.f("#pragma clang diagnostic ignored \"-Wunused-label\"");
-  code.f("#pragma clang diagnostic ignored \"-Wunused-function\"");
-  code.f("#pragma clang diagnostic ignored \"-Wunused-variable\"");
-  code.f("");
-  code.f("#include \"generated.hpp\"");
-  code.f("");
-  code.f("#include \"inst_impls.hpp\"");
-  code.f("#include \"magic_constants.hpp\"");
-  code.f("#include \"manual_functions.hpp\"");
-  code.f("");
-  code.f("#include \"bee/print.hpp\"");
-  code.f("");
-  code.f("namespace heaven_ice {{");
-  code.f("namespace {{");
-  code.f("");
-
-  code.s("ulong_t tmp_L;");
-  code.s("uword_t tmp_W;");
-  code.s("ubyte_t tmp_B;");
-
-  code.s("");
-  code.s("struct GeneratedImpl final : public GeneratedIntf {");
-  code.s("");
-  code.s("void JUMP_MAP(ulong_t addr) {");
-  code.s("  _log_call(__func__);");
-  code.s("");
-  code.s("  switch (addr) {");
-  for (auto&& [addr, fn_addr] : fn_jump_map) {
-    auto fn = functions.find(fn_addr)->second;
-    code.f("  case 0x{x}: $; break;", addr, fn.call_code());
-  }
-  code.s("  default: raise_error(\"No mapping for address: {x}\", "
-         "addr);");
-  code.s("  }");
-  code.s("  _log_ret(__func__);");
-  code.s("}");
-  code.s("");
-
-  for (auto&& [_, fn] : functions) {
-    bool is_manual = fn.manual_name.has_value();
-    if (is_manual) continue;
-    code.set_comment_out(is_manual);
-    auto&& insts = fn.insts;
-    auto name = fn.name();
-    code.f("void $() {{", name);
-    code.s("  _log_call(__func__);");
+  {
+    Code code;
+    print_pragmas(code);
+    code.s("#include \"generated.hpp\"");
     code.s("");
-    if (insts.begin()->pc != fn.start) { code.f("  goto L{x};", fn.start); }
-    print_one_fn(code, fn);
+    code.s("#include \"generated_impl.hpp\"");
     code.s("");
-    code.s("  end:");
-    code.s("  _log_ret(__func__);");
+    code.f("namespace heaven_ice {{");
+    code.s("");
+    print_dispatch(code);
+    std::vector<std::string> names = {"JUMP_MAP"};
+    for (const auto& table : jump_tables) { names.push_back(table.name()); }
+    for (ulong_t addr : thunk_addrs()) { names.push_back(F("J{x}", addr)); }
+    print_instantiations(code, names);
+    print_create(code);
     code.s("}");
-    code.set_comment_out(false);
+    bail_unit(write("generated.cpp", code));
+  }
+  auto shards = partition_functions(num_shards);
+  for (int i = 0; i < std::ssize(shards); i++) {
+    Code code;
+    print_pragmas(code);
+    code.s("#include \"generated_impl.hpp\"");
+    code.s("");
+    code.f("namespace heaven_ice {{");
     code.s("");
+    print_fns(code, shards[i], inliner, bodies);
+    std::vector<std::string> names;
+    for (const auto* fn : shards[i]) { names.push_back(fn->name()); }
+    print_instantiations(code, names);
+    code.s("}");
+    bail_unit(write(F("generated_$.cpp", i), code));
+  }
+  // Shards left over from a run with more of them
+  int removed = 0;
+  for (int i = num_shards;; i++) {
+    auto path = *output_dir / bee::FilePath(F("generated_$.cpp", i));
+    if (!bee::FileSystem::exists(path)) { break; }
+    bail_unit(bee::FileSystem::remove(path));
+    removed++;
+  }
+  timer.done("Code generation");
+  PE(
+    "Wrote $ of $ files to $, removed $ old shards",
+    written,
+    num_files,
+    *output_dir,
+    removed);
+  inliner.print_report();
+  return bee::ok();
+}
+
+std::string ToCpp::functions_to_cpp(
+  const std::map<ulong_t, std::vector<Instruction>>& fns,
+  const std::vector<JumpTableSpec>& tables,
+  Memory& rom,
+  int inline_budget)
+{
+  functions.clear();
+  jump_map.clear();
+  jump_tables.clear();
+  for (const auto& [start, insts] : fns) {
+    auto& fn = functions[start];
+    fn.start = start;
+    fn.insts = insts;
+    add_labels(fn);
+  }
+  for (const auto& table : tables) {
+    ulong_t end = table.base + (std::ssize(table.targets) - 1) * table.step;
+    for (int i = 0; i < std::ssize(table.targets); i++) {
+      jump_map.emplace(table.base + i * table.step, table.targets[i]);
+    }
+    jump_tables.push_back({.base = table.base, .end = end, .step = table.step});
   }
-  code.s("");
-  code.s("GeneratedImpl(bool v, const ManualFunctions::ptr& m)");
-  code.s(": _m(m), _verbose(v) {}");
-  code.s("void run() { _m->start(); }");
-  code.s("void jump_map(ulong_t addr) { JUMP_MAP(addr); }");
-  code.s("void vblank_int() { F5c88(); }");
-  code.s("void _log_call(const char* fn_name) const");
-  code.s("{");
-  code.s("  if (_verbose) P(\"Call $\", fn_name);");
-  code.s("}");
-  code.s("void _log_ret(const char* fn_name) const");
-  code.s("{");
-  code.s("  if (_verbose) P(\"Returned $\", fn_name);");
-  code.s("}");
-  code.s("ManualFunctions::ptr _m;");
-  code.s("bool _verbose;");
-  code.s("");
-  code.s("};");
-  code.s("");
-  code.s("}");
-  code.s("");
-  code.s("GeneratedIntf::ptr Generated::create(");
-  code.s("  bool verbose, const ManualFunctions::ptr& m)");
-  code.s("{");
-  code.s("  return std::make_shared<GeneratedImpl>(verbose, m);");
-  code.s("}");
-  code.s("");
-  code.s("}");
 
-  for (auto&& line : code.lines()) { P(line); }
-  return bee::ok();
+  Inliner inliner(inline_budget);
+  auto bodies = build_bodies(rom, inliner);
+  Code code;
+  print_impl_class(code);
+  print_dispatch(code);
+  print_fns(code, partition_functions(1).at(0), inliner, bodies);
+  return join_lines(code);
 }
 
 } // namespace heaven_ice
@@ -1,12 +1,51 @@
 #pragma once
 
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "instruction.hpp"
+#include "memory.hpp"
+#include "rom.hpp"
+#include "types.hpp"
+
+#include "bee/file_path.hpp"
 #include "bee/or_error.hpp"
 
 namespace heaven_ice {
 
 struct ToCpp {
  public:
-  static bee::OrError<> to_cpp(const std::string& content);
+  // Leaf functions with at most inline_budget instructions are inlined into
+  // their callers. Without an output_dir the code is printed as a single file,
+  // otherwise it's written there split in num_shards files, plus the common
+  // generated.cpp and the generated_impl.hpp header they share. Shard files
+  // from a previous run with more shards are removed. The generated library in
+  // mbuild and tools/generate.sh still use the single file.
+  static bee::OrError<> to_cpp(
+    const Rom::ptr& rom,
+    int inline_budget,
+    const std::optional<bee::FilePath>& output_dir,
+    int num_shards);
+
+  // Jump instructions step bytes apart starting at base, the i-th one lands on
+  // targets[i]
+  struct JumpTableSpec {
+    ulong_t base;
+    ulong_t step;
+    std::vector<ulong_t> targets;
+  };
+
+  // Recompiles the given functions, keyed by their entry point, instead of the
+  // ones found in the rom. Returns the class, the dispatch and the functions,
+  // without the includes. Used to test the transformations on small
+  // instruction streams.
+  static std::string functions_to_cpp(
+    const std::map<ulong_t, std::vector<Instruction>>& fns,
+    const std::vector<JumpTableSpec>& tables,
+    Memory& rom,
+    int inline_budget);
 };
 
 } // namespace heaven_ice
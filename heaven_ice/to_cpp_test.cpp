@@ -0,0 +1,350 @@
+#include "to_cpp.hpp"
+
+#include "magic_constants.hpp"
+
+#include "bee/print.hpp"
+#include "bee/testing.hpp"
+
+namespace heaven_ice {
+namespace {
+
+AddrMode d(int idx) { return AddrMode::make_reg(RegisterId::data(idx)); }
+
+AddrMode a(int idx) { return AddrMode::make_reg(RegisterId::addr(idx)); }
+
+AddrMode ind(int idx)
+{
+  return {.kind = AddrModeKind::AReg, .reg = RegisterId::addr(idx)};
+}
+
+AddrMode post_inc(int idx)
+{
+  return {.kind = AddrModeKind::PostInc, .reg = RegisterId::addr(idx)};
+}
+
+AddrMode pre_dec(int idx)
+{
+  return {.kind = AddrModeKind::PreDec, .reg = RegisterId::addr(idx)};
+}
+
+AddrMode disp(int idx, slong_t offset)
+{
+  return {
+    .kind = AddrModeKind::ALongDisp,
+    .imm = offset,
+    .reg = RegisterId::addr(idx),
+    .idx_size = SizeKind::Long,
+  };
+}
+
+AddrMode indexed(int idx, int idx2)
+{
+  return {
+    .kind = AddrModeKind::AXByteDisp,
+    .reg = RegisterId::addr(idx),
+    .reg2 = RegisterId::data(idx2),
+    .idx_size = SizeKind::Word,
+  };
+}
+
+AddrMode imm(SizeKind size, slong_t value)
+{
+  return AddrMode::make_imm(size, value);
+}
+
+AddrMode abs_addr(ulong_t addr) { return AddrMode::make_imm_addr(addr); }
+
+Instruction inst(
+  InstEnum name,
+  std::optional<SizeKind> size,
+  std::optional<AddrMode> src,
+  std::optional<AddrMode> dst = std::nullopt)
+{
+  return {.name = name, .size = size, .src = src, .dst = dst};
+}
+
+Instruction branch(Condition cond, ulong_t target)
+{
+  return {.name = InstEnum::Bcc, .cond = cond, .src = abs_addr(target)};
+}
+
+Instruction dbra(int counter, ulong_t target)
+{
+  return {
+    .name = InstEnum::DBcc,
+    .size = SizeKind::Word,
+    .cond = Condition::False,
+    .src = abs_addr(target),
+    .dst = d(counter),
+  };
+}
+
+Instruction dbcc(Condition cond, int counter, ulong_t target)
+{
+  auto inst = dbra(counter, target);
+  inst.cond = cond;
+  return inst;
+}
+
+Instruction movem(
+  SizeKind size,
+  uword_t mask,
+  std::optional<AddrMode> src,
+  std::optional<AddrMode> dst = std::nullopt)
+{
+  bool reverse = dst.has_value() && dst->kind == AddrModeKind::PreDec;
+  return {
+    .name = InstEnum::MOVEM,
+    .size = size,
+    .src = src,
+    .dst = dst,
+    .register_list = RegisterList{.reverse = reverse, .mask = mask},
+  };
+}
+
+Instruction call(ulong_t target)
+{
+  return {.name = InstEnum::BSR, .src = abs_addr(target)};
+}
+
+Instruction rts() { return {.name = InstEnum::RTS}; }
+
+// The instructions are laid out 2 bytes apart starting at start, which is
+// enough to give each one its own pc
+std::pair<ulong_t, std::vector<Instruction>> fn(
+  ulong_t start, std::vector<Instruction> insts)
+{
+  ulong_t pc = start;
+  for (auto& i : insts) {
+    i.pc = pc;
+    i.bytes = 2;
+    pc += 2;
+  }
+  return {start, std::move(insts)};
+}
+
+void run_test(
+  const std::map<ulong_t, std::vector<Instruction>>& fns,
+  const std::vector<ToCpp::JumpTableSpec>& tables = {},
+  int inline_budget = 0)
+{
+  // A small zeroed rom with one word set, for the folded rom reads
+  Memory rom(0x1000);
+  rom.w(0x800, 0x1234);
+  P(ToCpp::functions_to_cpp(fns, tables, rom, inline_budget));
+}
+
+using I = InstEnum;
+constexpr auto W = SizeKind::Word;
+constexpr auto L = SizeKind::Long;
+
+TEST(constant_address)
+{
+  run_test({
+    fn(0x100,
+       {
+         inst(I::MOVE, W, abs_addr(0x800), d(0)),
+         inst(I::MOVE, W, d(0), abs_addr(RAM_BEGIN + 0x10)),
+         inst(I::MOVE, L, imm(L, 0x40000000), abs_addr(VDP_CTRL1)),
+         inst(I::MOVE, W, abs_addr(CONTROLLER1_DATA1), d(1)),
+         inst(I::MOVE, W, d(1), abs_addr(0x900)),
+         rts(),
+       }),
+  });
+}
+
+TEST(register_promotion)
+{
+  run_test({
+    fn(0x100,
+       {
+         inst(I::MOVEQ, L, imm(L, 1), d(0)),
+         inst(I::ADDA, L, d(0), a(1)),
+         call(0x200),
+         inst(I::MOVE, W, ind(1), d(2)),
+         rts(),
+       }),
+    fn(0x200,
+       {
+         inst(I::MOVE, W, d(3), d(0)),
+         rts(),
+       }),
+  });
+}
+
+TEST(cc_liveness)
+{
+  run_test({
+    fn(0x100,
+       {
+         inst(I::ADD, W, d(1), d(0)),
+         inst(I::SUB, W, imm(W, 1), d(0)),
+         branch(Condition::NE, 0x100),
+         inst(I::TST, W, d(2)),
+         inst(I::TST, W, ind(0)),
+         inst(I::MOVEQ, L, imm(L, 0), d(3)),
+         rts(),
+       }),
+  });
+}
+
+TEST(fused_cc_test)
+{
+  run_test({
+    fn(0x100,
+       {
+         inst(I::CMP, W, d(1), d(0)),
+         branch(Condition::LS, 0x10e),
+         inst(I::TST, W, disp(0, 4)),
+         branch(Condition::EQ, 0x10e),
+         inst(I::CMPI, W, imm(W, 5), ind(1)),
+         branch(Condition::GT, 0x10e),
+         rts(),
+         inst(I::MOVEQ, L, imm(L, 0), d(2)),
+         rts(),
+       }),
+  });
+}
+
+TEST(inlining)
+{
+  run_test(
+    {
+      fn(0x100,
+         {
+           call(0x200),
+           call(0x200),
+           call(0x300),
+           rts(),
+         }),
+      fn(0x200,
+         {
+           inst(I::TST, W, d(0)),
+           branch(Condition::EQ, 0x206),
+           inst(I::ADDQ, W, imm(W, 1), d(0)),
+           rts(),
+         }),
+      fn(0x300,
+         {
+           call(0x200),
+           rts(),
+         }),
+    },
+    {},
+    16);
+}
+
+TEST(jump_table)
+{
+  run_test(
+    {
+      fn(0x100,
+         {
+           inst(I::JSR, std::nullopt, ind(1)),
+           inst(I::LEA, L, abs_addr(0x500), a(0)),
+           inst(I::JMP, std::nullopt, indexed(0, 0)),
+         }),
+      fn(0x200, {rts()}),
+      fn(0x300, {rts()}),
+    },
+    {{.base = 0x500, .step = 4, .targets = {0x200, 0x300}}});
+}
+
+TEST(tracing)
+{
+  run_test({
+    fn(0x100,
+       {
+         inst(I::MOVE, W, d(0), abs_addr(VDP_DATA1)),
+         call(0x200),
+         rts(),
+       }),
+    fn(0x200, {rts()}),
+  });
+}
+
+TEST(constant_propagation)
+{
+  run_test(
+    {
+      fn(0x100,
+         {
+           inst(I::LEA, L, abs_addr(0x504), a(1)),
+           inst(I::JSR, std::nullopt, ind(1)),
+           inst(I::LEA, L, abs_addr(RAM_BEGIN + 0x40), a(0)),
+           inst(I::MOVEQ, L, imm(L, 3), d(1)),
+           inst(I::MOVE, W, d(1), disp(0, 2)),
+           inst(I::ADDQ, W, imm(W, 1), d(1)),
+           inst(I::MOVE, W, d(1), ind(0)),
+           branch(Condition::True, 0x112),
+           inst(I::MOVE, W, d(1), ind(0)),
+           rts(),
+         }),
+      fn(0x200, {rts()}),
+      fn(0x300, {rts()}),
+    },
+    {{.base = 0x500, .step = 4, .targets = {0x200, 0x300}}});
+}
+
+TEST(block_operations)
+{
+  run_test({
+    fn(0x100,
+       {
+         // D0,D1,A0
+         movem(L, 0xc080, std::nullopt, pre_dec(7)),
+         inst(I::MOVE, L, post_inc(0), post_inc(1)),
+         dbra(2, 0x102),
+         inst(I::MOVE, W, d(3), post_inc(2)),
+         dbra(2, 0x106),
+         inst(I::MOVE, W, post_inc(3), abs_addr(VDP_DATA1)),
+         dbra(2, 0x10a),
+         // D0,D1
+         movem(W, 0x0003, post_inc(6)),
+         // A0 is part of the list and moved one register at a time
+         movem(W, 0x0101, post_inc(0)),
+         inst(I::CLR, W, std::nullopt, d(4)),
+         rts(),
+       }),
+  });
+}
+
+TEST(block_loop_stream_value)
+{
+  // The value stored is the pointer being incremented, so the loop can't be
+  // a fill
+  run_test({
+    fn(0x100,
+       {
+         inst(I::MOVE, L, a(1), post_inc(1)),
+         dbra(2, 0x100),
+         inst(I::MOVE, L, a(0), post_inc(1)),
+         dbra(0, 0x104),
+         inst(I::CLR, W, std::nullopt, d(4)),
+         rts(),
+       }),
+  });
+}
+
+TEST(counted_loops)
+{
+  run_test({
+    fn(0x100,
+       {
+         inst(I::MOVE, W, post_inc(0), d(1)),
+         inst(I::ADD, W, d(1), d(3)),
+         dbra(4, 0x102),
+         dbra(5, 0x100),
+         inst(I::TST, W, post_inc(1)),
+         dbcc(Condition::NE, 6, 0x108),
+         // Writes its own counter, left as a goto
+         inst(I::SUBQ, W, imm(W, 1), d(2)),
+         dbra(2, 0x10c),
+         inst(I::CLR, W, std::nullopt, d(7)),
+         rts(),
+       }),
+  });
+}
+
+} // namespace
+} // namespace heaven_ice
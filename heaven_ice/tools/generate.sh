@@ -1,7 +1,6 @@
 #!/bin/bash -eu
 
-make dev
-./build/dev/heaven_ice/heaven_ice to-cpp "$ROM" > tmp
+PROFILE=dev make
+./build/dev/heaven_ice/recompile to-cpp "$ROM" > tmp
 mv tmp heaven_ice/generated.cpp
 clang-format -i heaven_ice/generated.cpp
-
@@ -1,11 +1,16 @@
 #include "vdp.hpp"
 
 #include <algorithm>
+#include <array>
+#include <bitset>
 #include <cstring>
+#include <utility>
 
 #include "bit_manip.hpp"
+#include "indexed_frame.hpp"
 #include "magic_constants.hpp"
 #include "save_state.hpp"
+#include "tile_row.hpp"
 #include "vdp_rw.hpp"
 #include "vdp_target.hpp"
 
@@ -19,9 +24,11 @@ namespace {
 constexpr ulong_t VRAM_SIZE = 0x20000;
 constexpr int MAX_SPRITES = 80;
 constexpr int TILE_SIZE = 8;
+constexpr ulong_t TILE_BYTES = 32;
 
-constexpr int SCREEN_HEIGHT = 224;
-constexpr int SCREEN_WIDTH = 320;
+// TODO: PAL has a diff resolution
+constexpr int SCREEN_HEIGHT = IndexedFrame::Height;
+constexpr int SCREEN_WIDTH = IndexedFrame::Width;
 
 inline bool is_word_cmd(ulong_t cmd) { return ((cmd & 0xe000) == 0x8000); }
 inline bool is_long_cmd(ulong_t cmd) { return ((cmd & 0xff0c) == 0); }
@@ -376,6 +383,68 @@ struct PlaneCell {
   ulong_t _tile_addr;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Line
+//
+
+// One layer of a line, pixels are the same as in IndexedFrame, but color 0 is
+// transparent
+using Line = std::array<ubyte_t, SCREEN_WIDTH>;
+
+constexpr ubyte_t HighPriority = IndexedFrame::HighPriority;
+
+inline ubyte_t line_pixel(Priority priority, ulong_t palette, ulong_t color)
+{
+  return (priority == Priority::High ? HighPriority : 0) | (palette * 16) |
+         color;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TileCache
+//
+
+// Tiles decoded to one color index per pixel, kept both as stored and
+// horizontally flipped. A vertical flip is just reading the rows backwards.
+// Writes to VRAM mark the tiles they touch, which are decoded again the next
+// time they are drawn.
+struct TileCache {
+ public:
+  using Row = std::array<ubyte_t, TILE_SIZE>;
+  using VRAM = std::array<ulong_t, VRAM_SIZE / 2>;
+
+  TileCache() { _dirty.set(); }
+
+  void invalidate(ulong_t addr) { _dirty.set(addr / TILE_BYTES); }
+  void invalidate_all() { _dirty.set(); }
+
+  const Row& row(const VRAM& vram, ulong_t tile_addr, int row, bool xflip)
+  {
+    ulong_t idx = tile_addr / TILE_BYTES;
+    if (_dirty.test(idx)) { _decode(vram, idx); }
+    return _tiles[idx][xflip][row];
+  }
+
+ private:
+  static constexpr ulong_t NumTiles = VRAM_SIZE / TILE_BYTES;
+
+  using Tile = std::array<Row, TILE_SIZE>;
+
+  void _decode(const VRAM& vram, ulong_t idx)
+  {
+    auto& tile = _tiles[idx];
+    for (int y = 0; y < TILE_SIZE; y++) {
+      ulong_t waddr = idx * TILE_BYTES / 2 + y * 2;
+      ulong_t bits = (vram[waddr] << 16) | vram[waddr + 1];
+      TileRow::expand(bits, false, tile[false][y].data());
+      TileRow::expand(bits, true, tile[true][y].data());
+    }
+    _dirty.reset(idx);
+  }
+
+  std::array<std::array<Tile, 2>, NumTiles> _tiles;
+  std::bitset<NumTiles> _dirty;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // VDPRegisters
 //
@@ -446,7 +515,7 @@ struct VDPRegisters {
   ulong_t window_y() const { return at(0x12).get(0, 5) * 8; }
 
   bool window_right() const { return at(0x11).get(7, 1) == 1; }
-  bool window_bottom() const { return at(0x11).get(7, 1) == 1; }
+  bool window_bottom() const { return at(0x12).get(7, 1) == 1; }
 
   inline BB at(int idx) const { return _reg.at(idx); }
   inline BB& at(int idx) { return _reg.at(idx); }
@@ -480,6 +549,7 @@ struct VDPImpl final : public VDP {
   {
     _vram.fill(0);
     _cram.fill(0);
+    _update_palette();
     _vsram.fill(0);
   }
 
@@ -562,57 +632,49 @@ struct VDPImpl final : public VDP {
     img.save_pnm(bee::FilePath(F("sprites_{05}.pnm", dump_idx)));
   }
 
-  void render_sprites(pixel::Image& img, Priority priority) const
-  {
-    auto sprites = get_sprites();
-    for (auto& sprite : sprites) {
-      if (sprite.priority() != priority) continue;
-      render_sprite(img, sprite, sprite.y() - 128, sprite.x() - 128);
-    }
-    if (_verbose) P("VDP: Num sprites: $", sprites.size());
-  }
-
-  int hscroll_amount(Plane plane) const
+  int hscroll_amount(Plane plane, int y) const
   {
     ulong_t addr = _reg.hscroll_addr();
-    auto hscroll = _reg.hscroll_kind();
-    switch (hscroll) {
+    switch (_reg.hscroll_kind()) {
     case HScrollKind::WholeScreen:
-      switch (plane) {
-      case Plane::Foreground:
-        break;
-      case Plane::Background:
-        addr += 2;
-        break;
-      case Plane::Window:
-        raise_error("Window plane does not scroll");
-      }
       break;
-    default:
-      raise_error("Unsupported hscroll kind: $", hscroll);
+    case HScrollKind::Per8PixelStrips:
+      addr += (y & ~(TILE_SIZE - 1)) * 4;
+      break;
+    case HScrollKind::PerScanLine:
+      addr += y * 4;
+      break;
+    }
+    switch (plane) {
+    case Plane::Foreground:
+      break;
+    case Plane::Background:
+      addr += 2;
+      break;
+    case Plane::Window:
+      raise_error("Window plane does not scroll");
     }
-    if (_verbose) P("VDP: HScroll addr: {x}", addr);
     return BW(_vram.at(addr / 2)).get(0, 10);
   }
 
-  int vscroll_amount(Plane plane) const
+  int vscroll_amount(Plane plane, int x) const
   {
     ulong_t addr = 0;
-    auto vscroll = _reg.vscroll_kind();
-    switch (vscroll) {
+    switch (_reg.vscroll_kind()) {
     case VScrollKind::WholeScreen:
-      switch (plane) {
-      case Plane::Foreground:
-        break;
-      case Plane::Background:
-        addr += 2;
-        break;
-      case Plane::Window:
-        raise_error("Window plane does not scroll");
-      }
       break;
-    default:
-      raise_error("Unsupported vscroll kind: $", vscroll);
+    case VScrollKind::Per16PixelStrips:
+      addr += (x / 16) * 4;
+      break;
+    }
+    switch (plane) {
+    case Plane::Foreground:
+      break;
+    case Plane::Background:
+      addr += 2;
+      break;
+    case Plane::Window:
+      raise_error("Window plane does not scroll");
     }
     return BW(_vsram.at(addr / 2)).get(0, 10);
   }
@@ -626,136 +688,216 @@ struct VDPImpl final : public VDP {
     bool yflip,
     bool xflip) const
   {
-    ulong_t paddr = palette_idx * 0x20;
-    auto get_color = [&](int color) -> BW {
-      return _cram.at((paddr + color * 2) / 2);
-    };
     for (int dy = 0; dy < TILE_SIZE; dy++) {
+      int ty = yflip ? TILE_SIZE - 1 - dy : dy;
+      const auto& row = tile_row(tile_addr, ty, xflip);
       for (int dx = 0; dx < TILE_SIZE; dx++) {
-        int px = xflip ? x - dx + 7 : x + dx;
-        int py = yflip ? y - dy + 7 : y + dy;
+        int px = x + dx;
+        int py = y + dy;
 
         if (px < 0 || px >= img.width() || py < 0 || py >= img.height()) {
           continue;
         }
 
-        int nb_addr = tile_addr * 2 + dy * TILE_SIZE + dx;
-        BW word = _vram.at(nb_addr / 4);
-        auto color_idx = word.get((3 - (nb_addr % 4)) * 4, 4);
+        auto color_idx = row[dx];
         if (color_idx == 0) { continue; }
-        BW color = get_color(color_idx);
-        img.set_pixel(
-          py,
-          px,
-          color.get(1, 3) * 36,
-          color.get(5, 3) * 36,
-          color.get(9, 3) * 36);
+        const auto& color = _palette.at(palette_idx * 16 + color_idx);
+        img.set_pixel(py, px, color.r, color.g, color.b);
       }
     }
   }
 
-  void render_plane_cell(
-    pixel::Image& img, ulong_t addr, int y, int x, Priority priority) const
+  // The 8 color indexes of a tile row, left to right
+  const TileCache::Row& tile_row(ulong_t tile_addr, int row, bool xflip) const
   {
-    PlaneCell cell(_vram.at(addr / 2));
-    if (cell.priority() != priority) return;
-    render_tile(
-      img, cell.tile_addr(), cell.palette(), y, x, cell.yflip(), cell.xflip());
+    return _tiles.row(_vram, tile_addr, row, xflip);
   }
 
-  void render_plane(pixel::Image& img, Plane plane, Priority priority) const
+  // Draws the pixels [begin, end[ of a row of a cell, row counts from the top
+  // as displayed
+  void blend_cell_row(
+    ubyte_t* dst, const PlaneCell& cell, int row, int begin, int end) const
+  {
+    if (cell.yflip()) { row = TILE_SIZE - 1 - row; }
+    const auto& pixels = tile_row(cell.tile_addr(), row, cell.xflip());
+    ubyte_t attr = line_pixel(cell.priority(), cell.palette(), 0);
+    TileRow::blend(pixels.data(), attr, 0, dst, begin, end);
+  }
+
+  void render_plane_line(Line& line, Plane plane, int y) const
   {
     auto plane_addr = _reg.plane_addr(plane);
     int height = _reg.plane_height();
     int width = _reg.plane_width();
-    int scroll_x = hscroll_amount(plane);
-    int scroll_y = vscroll_amount(plane);
-    if (_verbose) {
-      P("VDP: Render plane: $", plane);
-      P("VDP: Plane size: $x$", height, width);
-      P("VDP: Plane addr: [{x}:{x}[",
-        plane_addr,
-        plane_addr + height * width * 2);
-      P("VDP: Scroll: $x$", scroll_y, scroll_x);
+    int scroll_x = hscroll_amount(plane, y);
+    bool vscroll_strips = _reg.vscroll_kind() == VScrollKind::Per16PixelStrips;
+    line.fill(0);
+    // A run ends at the end of a cell, or of a vscroll strip
+    for (int x = 0; x < SCREEN_WIDTH;) {
+      int plane_x = MOD(x - scroll_x, width * TILE_SIZE);
+      int plane_y = MOD(y + vscroll_amount(plane, x), height * TILE_SIZE);
+      ulong_t cell_addr =
+        plane_addr + (plane_x / TILE_SIZE + plane_y / TILE_SIZE * width) * 2;
+      PlaneCell cell(_vram.at(cell_addr / 2));
+      int col = plane_x % TILE_SIZE;
+      int end = std::min(SCREEN_WIDTH, x + TILE_SIZE - col);
+      if (vscroll_strips) { end = std::min(end, (x / 16 + 1) * 16); }
+      blend_cell_row(
+        line.data() + x, cell, plane_y % TILE_SIZE, col, col + end - x);
+      x = end;
     }
+  }
 
-    for (int y = 0; y <= img.height(); y += TILE_SIZE) {
-      int ay = DIV((y + scroll_y), TILE_SIZE);
-      int cy = MOD(ay, height);
-      int ty = ay * TILE_SIZE - scroll_y;
-      for (int x = 0; x <= img.width(); x += TILE_SIZE) {
-        int ax = DIV((x - scroll_x), TILE_SIZE);
-        int cx = MOD(ax, width);
-        int tx = ax * TILE_SIZE + scroll_x;
-
-        ulong_t tile_addr = plane_addr + (cx + cy * width) * 2;
-        render_plane_cell(img, tile_addr, ty, tx, priority);
+  // Sprites are drawn in order, a later sprite covers an earlier one, but a
+  // high priority sprite is never covered by a low priority one
+  void render_sprites_line(
+    Line& line, const std::vector<Sprite>& sprites, int y) const
+  {
+    for (const auto& sprite : sprites) {
+      int row = y - (sprite.y() - 128);
+      if (row < 0 || row >= sprite.height() * TILE_SIZE) continue;
+      int cy = row / TILE_SIZE;
+      int dy = row % TILE_SIZE;
+      if (sprite.yflip()) {
+        cy = sprite.height() - 1 - cy;
+        dy = TILE_SIZE - 1 - dy;
+      }
+      ubyte_t attr = line_pixel(sprite.priority(), sprite.palette(), 0);
+      ubyte_t keep = sprite.priority() == Priority::High ? 0 : HighPriority;
+      int x0 = sprite.x() - 128;
+      for (int c = 0; c < sprite.width(); c++) {
+        int x = x0 + c * TILE_SIZE;
+        int begin = std::max(0, -x);
+        int end = std::min(TILE_SIZE, SCREEN_WIDTH - x);
+        if (begin >= end) continue;
+        int cx = sprite.xflip() ? sprite.width() - 1 - c : c;
+        ulong_t addr = sprite.tiles_addr() + (cx * sprite.height() + cy) * 32;
+        const auto& pixels = tile_row(addr, dy, sprite.xflip());
+        TileRow::blend(
+          pixels.data(), attr, keep, line.data() + x + begin, begin, end);
       }
     }
   }
 
-  void render_window(pixel::Image& img, Priority priority) const
+  // The window covers all the lines of its vertical range, and on the other
+  // lines the columns of its horizontal range. Returns the columns [x0, x1[ it
+  // covers on line y.
+  std::pair<int, int> window_columns(int y) const
   {
-    if (_verbose) {
-      P("VDP: Render plane: Window");
-      P("VDP: Bottom: $", _reg.window_bottom());
-      P("VDP: Right: $", _reg.window_right());
-    }
-    auto addr = _reg.plane_addr(Plane::Window);
-    int y0, y1;
-    int x0, x1;
-    if (_reg.window_bottom()) {
-      y0 = _reg.window_y();
-      y1 = SCREEN_HEIGHT;
-    } else {
-      y0 = 0;
-      y1 = _reg.window_y();
-    }
-
-    // if (_reg.window_right()) {
-    //   x0 = _reg.window_x();
-    //   x1 = SCREEN_WIDTH;
-    // } else {
-    //   x0 = 0;
-    //   x1 = _reg.window_x();
-    // }
+    int wy = _reg.window_y();
+    bool in_rows = _reg.window_bottom() ? y >= wy : y < wy;
+    if (in_rows) { return {0, SCREEN_WIDTH}; }
+    int wx = std::min<int>(_reg.window_x(), SCREEN_WIDTH);
+    if (_reg.window_right()) { return {wx, SCREEN_WIDTH}; }
+    return {0, wx};
+  }
 
-    // TODO: this is hack because the above is not working
-    x0 = 0;
-    x1 = SCREEN_WIDTH;
+  // The window doesn't scroll or wrap
+  bool render_window_line(Line& line, int y) const
+  {
+    auto [x0, x1] = window_columns(y);
+    if (x0 >= x1) { return false; }
 
-    int height = _reg.plane_height();
+    auto addr = _reg.plane_addr(Plane::Window);
     int width = _reg.plane_width();
-    if (_verbose) {
-      P("VDP: Plane pos: $:$x$:$", y0, y1, x0, x1);
-      P("VDP: Plane addr: [{x}:{x}[", addr, addr + (height * width * 2) / 64);
+    int cell_y = y / TILE_SIZE * TILE_SIZE;
+    uword_t line_addr = addr + width * cell_y / 4;
+    line.fill(0);
+    for (int x = x0; x < x1; x += TILE_SIZE) {
+      uword_t cell_addr = line_addr + x / 4;
+      PlaneCell cell(_vram.at(cell_addr / 2));
+      blend_cell_row(line.data() + x, cell, y - cell_y, 0, TILE_SIZE);
     }
-    for (int y = y0; y < y1; y += TILE_SIZE) {
-      uword_t line_addr = addr + width * y / 4;
-      for (int x = x0; x < x1; x += TILE_SIZE) {
-        uword_t cell_addr = line_addr + x / 4;
-        render_plane_cell(img, cell_addr, y, x, priority);
-      }
+    return true;
+  }
+
+  // Each pixel takes the first opaque layer in the order window, sprites,
+  // foreground, background, high priority first, then the same for low
+  // priority
+  void render_line(
+    ubyte_t* out, const std::vector<Sprite>& sprites, int y) const
+  {
+    Line background, foreground, sprite_line, window;
+    render_plane_line(background, Plane::Background, y);
+    render_plane_line(foreground, Plane::Foreground, y);
+    sprite_line.fill(0);
+    render_sprites_line(sprite_line, sprites, y);
+    bool has_window = render_window_line(window, y);
+
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      int best = -1;
+      ubyte_t pixel = 0;
+      auto consider = [&](ubyte_t p, int layer) {
+        if ((p & 0xf) == 0) return;
+        int rank = layer + ((p & HighPriority) != 0 ? 4 : 0);
+        if (rank > best) {
+          best = rank;
+          pixel = p;
+        }
+      };
+      consider(background[x], 0);
+      consider(foreground[x], 1);
+      consider(sprite_line[x], 2);
+      if (has_window) { consider(window[x], 3); }
+      out[x] = pixel;
     }
   }
 
-  pixel::Image render() const override
+  // Prints what the renderer used to log for each layer pass, so verbose logs
+  // stay comparable with older ones
+  void log_layers(const std::vector<Sprite>& sprites) const
   {
-    // TODO: PAL has a diff resolution
-    pixel::Image img(SCREEN_HEIGHT, SCREEN_WIDTH);
+    for (int pass = 0; pass < 2; pass++) {
+      for (auto plane : {Plane::Background, Plane::Foreground}) {
+        P("VDP: HScroll addr: {x}",
+          _reg.hscroll_addr() + (plane == Plane::Background ? 2 : 0));
+        auto plane_addr = _reg.plane_addr(plane);
+        int height = _reg.plane_height();
+        int width = _reg.plane_width();
+        P("VDP: Render plane: $", plane);
+        P("VDP: Plane size: $x$", height, width);
+        P("VDP: Plane addr: [{x}:{x}[",
+          plane_addr,
+          plane_addr + height * width * 2);
+        P("VDP: Scroll: $x$",
+          vscroll_amount(plane, 0),
+          hscroll_amount(plane, 0));
+      }
+      P("VDP: Num sprites: $", sprites.size());
+      P("VDP: Render plane: Window");
+      P("VDP: Bottom: $", _reg.window_bottom());
+      P("VDP: Right: $", _reg.window_right());
+      auto addr = _reg.plane_addr(Plane::Window);
+      int height = _reg.plane_height();
+      int width = _reg.plane_width();
+      int y0 = _reg.window_bottom() ? _reg.window_y() : 0;
+      int y1 = _reg.window_bottom() ? SCREEN_HEIGHT : _reg.window_y();
+      P("VDP: Plane pos: $:$x$:$", y0, y1, 0, SCREEN_WIDTH);
+      P("VDP: Plane addr: [{x}:{x}[", addr, addr + (height * width * 2) / 64);
+    }
+  }
 
-    if (_verbose) P("VDP: Render");
+  // Renders one line at a time, all the layers of a line are resolved in a
+  // single pass over it. The frame is reused, it's only valid until the next
+  // call.
+  const IndexedFrame& render() override
+  {
+    auto sprites = get_sprites();
+    if (_verbose) {
+      P("VDP: Render");
+      log_layers(sprites);
+    }
 
-    for (auto pri : {Priority::Low, Priority::High}) {
-      render_plane(img, Plane::Background, pri);
-      render_plane(img, Plane::Foreground, pri);
-      render_sprites(img, pri);
-      render_window(img, pri);
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      render_line(_frame.line(y), sprites, y);
     }
+    _frame.palette = _palette;
 
-    return img;
+    return _frame;
   }
 
+  const Palette& palette() const override { return _palette; }
+
   bool vblank_enabled() const override
   {
     return _reg.mode().vertical_interrupts();
@@ -776,7 +918,9 @@ struct VDPImpl final : public VDP {
   {
     load_state_gen(_reg, reader);
     load_state_array(_vram, reader);
+    _tiles.invalidate_all();
     load_state_array(_cram, reader);
+    _update_palette();
     load_state_array(_vsram, reader);
     load_state_gen(_partial_ctrl, reader);
     load_state_gen(_cmd_hi, reader);
@@ -1019,9 +1163,11 @@ struct VDPImpl final : public VDP {
     switch (dest) {
     case VDPTarget::VRAM:
       _vram.at(waddr) = data;
+      _tiles.invalidate(addr);
       break;
     case VDPTarget::CRAM:
       _cram.at(waddr) = data;
+      _update_color(waddr);
       break;
     case VDPTarget::VSRAM:
       _vsram.at(waddr) = data;
@@ -1034,6 +1180,22 @@ struct VDPImpl final : public VDP {
     }
   }
 
+  // Each CRAM word is 3 bits per channel, ----bbb-ggg-rrr-
+  void _update_color(ulong_t idx)
+  {
+    BW cram = _cram.at(idx);
+    _palette.at(idx) = Color{
+      .r = ubyte_t(cram.get(1, 3) * 36),
+      .g = ubyte_t(cram.get(5, 3) * 36),
+      .b = ubyte_t(cram.get(9, 3) * 36),
+    };
+  }
+
+  void _update_palette()
+  {
+    for (ulong_t idx = 0; idx < _cram.size(); idx++) { _update_color(idx); }
+  }
+
   uword_t _read_vdp(VDPTarget dest, ulong_t addr) const
   {
     if (addr % 2 == 1) { raise_error("Invalid odd read address: {x}", addr); }
@@ -1064,10 +1226,18 @@ struct VDPImpl final : public VDP {
 
   VDPRegisters _reg;
 
-  std::array<ulong_t, VRAM_SIZE / 2> _vram;
-  std::array<ulong_t, 0x40> _cram;
+  TileCache::VRAM _vram;
+  std::array<ulong_t, PALETTE_SIZE> _cram;
   std::array<ulong_t, 0x28> _vsram;
 
+  // Kept in sync with _cram on every write
+  Palette _palette;
+
+  IndexedFrame _frame;
+
+  // Decoded lazily while rendering
+  mutable TileCache _tiles;
+
   bool _partial_ctrl = false;
   ulong_t _cmd_hi;
 
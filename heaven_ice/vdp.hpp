@@ -2,11 +2,11 @@
 
 #include <memory>
 
+#include "indexed_frame.hpp"
 #include "io_intf.hpp"
+#include "palette.hpp"
 #include "types.hpp"
 
-#include "pixel/image.hpp"
-
 namespace heaven_ice {
 
 struct VDP : public IOIntf {
@@ -21,7 +21,10 @@ struct VDP : public IOIntf {
 
   virtual bool vblank_enabled() const = 0;
 
-  virtual pixel::Image render() const = 0;
+  virtual const IndexedFrame& render() = 0;
+
+  // The current CRAM as host colors, for consumers of indexed frames
+  virtual const Palette& palette() const = 0;
 
   virtual void set_bus(const IOIntf::ptr& bus) = 0;
 